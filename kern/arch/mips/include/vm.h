@@ -114,17 +114,20 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Requests for the same page are merged (TLBSHOOTDOWN_SAME).
  */
 
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
-	int ts_placeholder;
-	int ts_cmindex;
+	vaddr_t ts_vaddr;	/* user page to drop */
+	unsigned ts_cmindex;	/* coremap index of the frame it maps */
 };
 
 #define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_SAME(a, b) \
+	((a)->ts_vaddr == (b)->ts_vaddr && (a)->ts_cmindex == (b)->ts_cmindex)
 
 
 #endif /* _MIPS_VM_H_ */
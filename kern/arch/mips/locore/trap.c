@@ -188,6 +188,9 @@ mips_trap(struct trapframe *tf)
 
 		mainbus_interrupt(tf);
 
+		/* Run anything the interrupt woke that outranks us. */
+		thread_preempt();
+
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
 			KASSERT(curthread->t_iplhigh_count == 1);
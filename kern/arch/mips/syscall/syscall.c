@@ -40,6 +40,7 @@
 #include <proc_syscall.h>
 #include <addrspace.h>
 #include <proc.h>
+#include <slab.h>
 
 /*
  * System call dispatcher.
@@ -90,6 +91,8 @@ syscall(struct trapframe *tf)
 	int ret1 = 0;
 	off_t pos;
 	int32_t whence = 0;
+	//mmap
+	int32_t fd = 0;
 	//
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -185,6 +188,43 @@ syscall(struct trapframe *tf)
 		case SYS_sbrk:
 		err = sys_sbrk((int)tf->tf_a0, (vaddr_t*)&retval);
 		break;
+
+		case SYS_mmap:
+		//fd and the 64-bit offset are the 5th and 6th arguments, on the stack
+		err = copyin((const_userptr_t)tf->tf_sp + 16, &fd, sizeof(int32_t));
+		if(!err){
+			err = copyin((const_userptr_t)tf->tf_sp + 24, &pos, sizeof(off_t));
+		}
+		if(!err){
+			err = sys_mmap((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+				       (int)tf->tf_a3, fd, pos, (vaddr_t *)&retval);
+		}
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_shmget:
+		err = sys_shmget((int)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2, &retval);
+		break;
+
+		case SYS_shmat:
+		err = sys_shmat((int)tf->tf_a0, (const void *)tf->tf_a1, (int)tf->tf_a2,
+				(vaddr_t *)&retval);
+		break;
+
+		case SYS_shmdt:
+		err = sys_shmdt((vaddr_t)tf->tf_a0);
+		break;
+
+		case SYS_shmctl:
+		err = sys_shmctl((int)tf->tf_a0, (int)tf->tf_a1, (userptr_t)tf->tf_a2);
+		break;
+
+		case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -238,7 +278,7 @@ enter_forked_process(void *data1, unsigned long data2)
 	newtfstack.tf_v0 = 0;
 	newtfstack.tf_a3 = 0;
 	newtfstack.tf_epc += 4;
-	kfree(oldtf);
+	kmem_cache_free(trapframe_cache, oldtf);
 	oldtf = NULL;
 
 	struct addrspace * newas = (struct addrspace*) data2;
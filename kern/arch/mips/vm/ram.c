@@ -160,24 +160,47 @@ void cm_init(void) {
 	cm_addr = ram_stealmem(cm_page);
 	coremap = (void *)PADDR_TO_KVADDR(cm_addr);
 	// init coremap, 1 fixed, 2 free
-	int fixedPage = ( firstpaddr + PAGE_SIZE - 1 )/ PAGE_SIZE;
-	for(int i = 0; i<fixedPage; i++){
+	unsigned fixedPage = ( firstpaddr + PAGE_SIZE - 1 )/ PAGE_SIZE;
+	for(unsigned i = 0; i<fixedPage; i++){
 		coremap[i].cm_status = Fixed;
 		coremap[i].cm_len = 0;
+		coremap[i].cm_refcount = 0;
 		coremap[i].cm_pid = -1;
 		coremap[i].cm_isbusy = false;
 		coremap[i].cm_intlb = false;
 		coremap[i].cm_pte = NULL;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_shm = NULL;
+		coremap[i].cm_cow = NULL;
+		coremap[i].cm_tlbcpus = 0;
 		coremap[i].cm_sec = 0;
+		coremap[i].cm_ref = false;
+		coremap[i].cm_zeroed = false;
+		coremap[i].cm_pageref = NULL;
+		coremap[i].cm_next = 0;
+		coremap[i].cm_prev = 0;
 	}
+	// 3 free list, lowest frame first
 	for(unsigned i = fixedPage; i < cm_num; i++){
 		coremap[i].cm_status = Free;
 		coremap[i].cm_len = 0;
+		coremap[i].cm_refcount = 0;
 		coremap[i].cm_pid = -1;
 		coremap[i].cm_isbusy = false;
 		coremap[i].cm_intlb = false;
 		coremap[i].cm_pte = NULL;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_shm = NULL;
+		coremap[i].cm_cow = NULL;
+		coremap[i].cm_tlbcpus = 0;
 		coremap[i].cm_sec = 0;
+		coremap[i].cm_ref = false;
+		coremap[i].cm_zeroed = false;
+		coremap[i].cm_pageref = NULL;
+		coremap[i].cm_next = (i + 1 < cm_num) ? i + 1 : 0;
+		coremap[i].cm_prev = (i > fixedPage) ? i - 1 : 0;
 	}
+	cm_freehead = (fixedPage < cm_num) ? fixedPage : 0;
+	cm_nfree = cm_num - fixedPage;
 
 }
@@ -850,8 +850,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* pages are moved with emufs_read and emufs_write */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
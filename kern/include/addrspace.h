@@ -36,10 +36,13 @@
 
 
 #include <vm.h>
+#include <array.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
 struct lock;
+struct shm_segment;
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -51,21 +54,109 @@ struct lock;
 struct pageTableNode{
     vaddr_t pt_vas;
     paddr_t pt_pas;
-    // bool pt_isDirty;
+    bool pt_isDirty;    //modified since last written to swap; map writable
     bool pt_inDisk;
+    bool pt_isCow;      //frame may be shared with a forked copy or be the zero frame; map read-only
+    bool pt_hasSlot;    //pt_bm_index is a swap slot owned by this page
+    bool pt_isFile;     //never written: contents can be reread from the region's file
+    bool pt_inFile;     //not resident; fill from the file on the next fault
+    bool pt_ahead;      //mapped ahead of use by fault-around, not faulted on since
     unsigned pt_bm_index;
     // int pt_permission;
-    struct pageTableNode *next;
+};
+
+/*
+ * Two-level page table, MIPS-style 10/10/12 split: the top 10 bits of
+ * a user address index the directory, the next 10 bits index a
+ * second-level table, and the low 12 bits are the page offset.
+ * The directory and each second-level table (one per 4 MB window) are
+ * allocated the first time a page in them is mapped.
+ */
+#define PT_ENTRIES          1024
+#define PT_L1_INDEX(va)     (((va) >> 22) & (PT_ENTRIES - 1))
+#define PT_L2_INDEX(va)     (((va) >> 12) & (PT_ENTRIES - 1))
+#define PT_L1_SPAN          (PT_ENTRIES * PAGE_SIZE)
+
+/*
+ * The entry of a page that stays out in swap can be reclaimed
+ * (vm_pt_reclaim): its second-level slot then holds just the swap slot,
+ * as an odd value, since real entries are word-aligned. vm_pt_expand
+ * turns it back into an entry when the page is wanted again.
+ */
+#define PT_ISRECLAIMED(p)   (((uintptr_t)(p) & 1) != 0)
+#define PT_RECLAIMED(slot)  ((struct pageTableNode *)(((uintptr_t)(slot) << 1) | 1))
+#define PT_RECLAIMEDSLOT(p) ((unsigned)((uintptr_t)(p) >> 1))
+
+/*
+ * A second-level table left with nothing but reclaimed entries is
+ * folded (pt_fold): its directory slot then points, odd-tagged the same
+ * way, at a struct pt_folded, which keeps the swap slots as runs of
+ * consecutive slots for consecutive pages, followed in memory by its
+ * pf_nruns struct pt_run. pf_present says which pages still have one;
+ * pt_release_range only clears bits, so runs never need splitting.
+ * pt_unfold rebuilds the table when one of its pages is wanted again.
+ */
+struct pt_run{
+    uint16_t pr_index;      //second-level index of the first page
+    uint16_t pr_count;
+    unsigned pr_slot;       //swap slot of the first page
+};
+
+struct pt_folded{
+    unsigned pf_nruns;
+    unsigned pf_npresent;
+    uint32_t pf_present[PT_ENTRIES / 32];
+};
+
+#define PT_ISFOLDED(l2)     (((uintptr_t)(l2) & 1) != 0)
+#define PT_FOLDED(pf)       ((struct pageTableNode **)((uintptr_t)(pf) | 1))
+#define PT_FOLDEDTABLE(l2)  ((struct pt_folded *)((uintptr_t)(l2) & ~(uintptr_t)1))
+#define PT_FOLDEDRUNS(pf)   ((struct pt_run *)((pf) + 1))
+
+/*
+ * TLB address space ID on one cpu. It is only valid while aa_gen
+ * matches that cpu's allocator generation (0 = never had one).
+ */
+struct as_asid{
+    uint32_t aa_gen;
+    unsigned aa_asid;
 };
 
 struct regionInfoNode{
     vaddr_t as_vbase;
     size_t as_npages;
     int as_permission;
+    /*
+    *Regions loaded from an executable keep a reference to it; the
+    *as_filesize bytes at file offset as_offset belong at as_fileva,
+    *and the rest of the region is zero-filled.
+    */
+    struct vnode *as_vnode;
+    off_t as_offset;
+    vaddr_t as_fileva;
+    size_t as_filesize;
+    /* MAP_SHARED or MAP_PRIVATE, maybe with MAP_ANON, for mmap regions; else 0 */
+    int as_mapflags;
+    /*
+    *Shared memory segment attached here (shmat, or a MAP_SHARED
+    *mapping), else NULL. Its pages are the segment's, and as_fileva
+    *is where the start of the segment would be.
+    */
+    struct shm_segment *as_shm;
     // int as_tmp_permission;
-    struct regionInfoNode *next;
 };
 
+/*
+ * Array of regions. An address space keeps its regions sorted by
+ * as_vbase so a fault can find its region by binary search.
+ */
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(regionInfoNode, ADDRSPACEINLINE);
+DEFARRAY(regionInfoNode, ADDRSPACEINLINE);
+
 
 struct addrspace {
 #if OPT_DUMBVM
@@ -77,15 +168,39 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        struct pageTableNode *pageTable;
-        struct regionInfoNode *regionInfo;
+        struct pageTableNode ***pageTable;
+        struct lock *as_lock;   /* held while the page table is walked or changed */
+        uint32_t as_cpus;       /* cpus (1 << c_number) it has been active on */
+        struct as_asid as_asid[MAXCPUS];
+        struct regionInfoNodearray *as_regions; /* sorted by as_vbase */
+        struct regionInfoNode *as_lastregion;   /* hint: last region looked up */
         vaddr_t heap_vbase;
         size_t heap_vbound;
+        vaddr_t mmap_vbase;     /* lowest mmap region, or AS_MMAPTOP */
+        vaddr_t stack_vbase;    /* lowest stack page so far; grows down on faults */
+        size_t as_stacklimit;   /* RLIMIT_STACK, in pages */
+        vaddr_t as_lastfault;   /* for spotting sequential faults */
+        int as_seqdir;          /* +1 or -1 page per fault while sequential */
+        unsigned as_seqrun;     /* sequential faults in a row */
+        unsigned as_swapnext;   /* next free slot of its swap run */
+        unsigned as_swapend;    /* end of the run (cm_lock) */
+        unsigned as_nswapped;   /* pages swapped out since its entries were last reclaimed (cm_lock) */
+        struct addrspace *as_next;      /* list of all address spaces */
 
         /* Put stuff here for your VM system */
 #endif
 };
 
+#if !OPT_DUMBVM
+/*
+ * The stack may grow down to as_stacklimit pages below USERSTACK; mmap
+ * regions are stacked downward from there. Only address space is set
+ * aside: as long as there are no mappings, the heap may grow on into
+ * the unused part of the stack's range (see as_heap_limit).
+ */
+#define AS_MMAPTOP(as)      (USERSTACK - (as)->as_stacklimit * PAGE_SIZE)
+#endif
+
 /*
  * Functions in addrspace.c:
  *
@@ -123,6 +238,38 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - back the region at VADDR with FILESIZE bytes of
+ *                vnode V at OFFSET; its pages are read in when first
+ *                touched instead of by load_elf. (Not in dumbvm.)
+ *
+ *    as_region_lookup - return the region containing VADDR, or NULL.
+ *                Checks the region of the previous lookup first, since
+ *                faults tend to come in runs within one region.
+ *
+ *    as_define_mmap - add an mmap region of NPAGES pages below the
+ *                lowest existing one, backed by FILESIZE bytes of
+ *                vnode V at OFFSET (or anonymous if V is NULL). Hands
+ *                back its address. (Not in dumbvm.)
+ *
+ *    as_heap_limit - how far the heap break may go: up to the lowest
+ *                mmap region, or else to the guard page below the
+ *                stack. (Not in dumbvm.)
+ *
+ *    as_stack_floor - how far down the stack may grow: to its rlimit,
+ *                but never into the guard page above the heap.
+ *                (Not in dumbvm.)
+ *
+ *    as_unmap  - remove NPAGES pages at VADDR from the mmap region they
+ *                lie in. (Not in dumbvm.)
+ *
+ *    as_define_shm - attach NPAGES pages of shared memory segment SEG,
+ *                from page FIRST on, below the lowest mmap region, like
+ *                as_define_mmap. (Not in dumbvm.)
+ *
+ *    as_detach_shm - remove the region at VADDR that a segment is
+ *                attached at and hand back the segment, for the caller
+ *                to drop with shm_detach. (Not in dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -141,6 +288,91 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+struct regionInfoNode *as_region_lookup(struct addrspace *as, vaddr_t vaddr);
+int               as_define_mmap(struct addrspace *as, size_t npages,
+                                 int prot, int mapflags, struct vnode *v,
+                                 off_t offset, size_t filesize,
+                                 vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages);
+int               as_define_shm(struct addrspace *as, struct shm_segment *seg,
+                                unsigned first, size_t npages, int prot,
+                                vaddr_t *ret);
+int               as_detach_shm(struct addrspace *as, vaddr_t vaddr,
+                                struct shm_segment **ret);
+vaddr_t           as_heap_limit(struct addrspace *as);
+vaddr_t           as_stack_floor(struct addrspace *as);
+
+/*
+ * Page table operations (also in addrspace.c):
+ *
+ *    pt_lookup - return the page table entry for VADDR, or NULL if
+ *                there is none or it has been reclaimed.
+ *
+ *    pt_slot   - return the second-level slot for VADDR, which may
+ *                hold a reclaimed entry, or NULL if its table does not
+ *                exist or is folded.
+ *
+ *    pt_isreclaimed - return whether the entry for VADDR is reclaimed,
+ *                in a folded table or not.
+ *
+ *    pt_insert - install PTE at PTE->pt_vas, allocating the directory
+ *                and second-level table (or unfolding it) if needed.
+ *                Returns ENOMEM on out-of-memory error.
+ *
+ *    pt_remove - clear the slot for VADDR. Does not free the entry.
+ *
+ *    pt_release_range - remove and free every entry in [VSTART, VEND),
+ *                releasing its page, and drop them from the TLB. Only
+ *                second-level tables that exist are visited. Called
+ *                with as_lock held.
+ *
+ *    pt_fold   - fold second-level table L1 if it holds only reclaimed
+ *                entries, or free it if it holds none at all. Returns
+ *                true if the table went away. Called with as_lock held.
+ *
+ *    pt_unfold - rebuild the table of VADDR if it is folded. Returns
+ *                ENOMEM on out-of-memory error. Called with as_lock
+ *                held.
+ */
+
+struct pageTableNode *pt_lookup(struct addrspace *as, vaddr_t vaddr);
+struct pageTableNode **pt_slot(struct addrspace *as, vaddr_t vaddr);
+bool              pt_isreclaimed(struct addrspace *as, vaddr_t vaddr);
+int               pt_insert(struct addrspace *as, struct pageTableNode *pte);
+void              pt_remove(struct addrspace *as, vaddr_t vaddr);
+void              pt_release_range(struct addrspace *as, vaddr_t vstart,
+                                   vaddr_t vend);
+bool              pt_fold(struct addrspace *as, unsigned l1);
+int               pt_unfold(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Page table entries have an object cache of their own (addrspace.c):
+ *
+ *    pte_alloc - return an uninitialized entry, or NULL.
+ *
+ *    pte_free  - free an entry. Called without cm_lock, as a slab page
+ *                left empty goes back to the coremap.
+ *
+ *    pte_printstats - print cache usage (vmstat).
+ *
+ *    as_bootstrap - set up the list of address spaces and the entry
+ *                cache.
+ *
+ *    as_reclaim_all - reclaim the entries of swapped-out pages in every
+ *                address space that has had pages swapped out since
+ *                its last time. Called by the pageout daemon, with no
+ *                as_lock held.
+ */
+
+struct pageTableNode *pte_alloc(void);
+void              pte_free(struct pageTableNode *pte);
+void              pte_printstats(void);
+void              as_bootstrap(void);
+void              as_reclaim_all(void);
 
 
 /*
@@ -37,6 +37,18 @@
 
 extern unsigned num_cpus;
 
+/*
+ * Scheduler levels (thread.c). Each cpu has a run queue per level and
+ * a thread's t_priority says which it goes on, 0 being the highest.
+ * At level L a thread runs SCHED_QUANTUM(L) hardclocks before it drops
+ * a level; waking up from wchan_sleep lifts it a level; and every
+ * SCHED_BOOST_HARDCLOCKS everything goes back to level 0, so threads
+ * stuck at the bottom behind busier ones do not starve.
+ */
+#define SCHED_LEVELS		4
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_BOOST_HARDCLOCKS	100
+
 /*
  * Per-cpu structure
  *
@@ -62,13 +74,16 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_stealseed;		/* For picking steal victims */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_LEVELS]; /* Run queues, by level */
+	unsigned c_runcount;		/* Threads on all the run queues */
+	unsigned c_curprio;		/* Level of c_curthread */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -83,10 +98,15 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * Duplicate requests are merged, and if the queue overflows
+	 * c_shootdown_all is set and the whole TLB gets flushed
+	 * instead.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_all;
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -156,6 +176,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * Requests queued while an earlier one is still pending share its IPI.
+ * ipi_tlbshootdown_mask queues one on every CPU whose bit
+ * (1 << c_number) is set in the mask, except the current one.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -170,6 +193,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_mask(uint32_t cpumask, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
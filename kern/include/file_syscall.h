@@ -9,7 +9,9 @@ struct fileHandle{
 	int flags;
 	int refcount;
 };
-int fileHandle_init(char * filename, struct vnode *vn, struct fileHandle ** fh, off_t offset, int flags, int refcount);
+void fileHandle_bootstrap(void);
+int fileHandle_init(struct vnode *vn, struct fileHandle ** fh, off_t offset, int flags, int refcount);
+void fileHandle_free(struct fileHandle *fh);
 int fileTable_init(void);
 int sys_open(const char * filename, int flags, int * retval);
 int sys_write(int fd, const void *, size_t len, int * retval);
@@ -69,6 +69,11 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	unsigned long p_faultsavoided;	/* TLB faults fault-around saved (as_lock) */
+	unsigned long p_minflt;		/* faults served from memory (as_lock) */
+	unsigned long p_majflt;		/* faults that read the page in (as_lock) */
+	unsigned long p_cminflt;	/* the same for children reaped by waitpid */
+	unsigned long p_cmajflt;
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -111,6 +116,15 @@ struct proc *proc_create_runprogram(const char *name);
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/* Take a process out of procTable, before freeing it. */
+void proc_unlist(struct proc *proc);
+
+/* Free a process structure whose contents are already released. */
+void proc_free(struct proc *proc);
+
+/* Print per-process VM counters (vmstat). */
+void proc_printstats(void);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -3,10 +3,22 @@
 #include <types.h>
 #include <limits.h>
 
+struct kmem_cache;
+extern struct kmem_cache *trapframe_cache;
+
+void proc_syscall_bootstrap(void);
+
 int sys_getpid(pid_t * retval);
 int sys_fork(struct trapframe * tf, int * retval);
 int sys_waitpid(pid_t pid, int * status, int options, pid_t *retval);
 void sys__exit(int exitcode, bool trap_sig);
 int sys_execv(const char * program, char ** args);
 int sys_sbrk(int amount, vaddr_t * retval);
+int sys_mmap(void * addr, size_t len, int prot, int flags, int fd, off_t offset, vaddr_t * retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_shmget(int key, size_t size, int flags, int * retval);
+int sys_shmat(int id, const void * addr, int flags, vaddr_t * retval);
+int sys_shmdt(vaddr_t addr);
+int sys_shmctl(int id, int cmd, userptr_t buf);
+int sys_getrusage(int who, userptr_t usage);
 #endif
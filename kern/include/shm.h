@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory segments (shmget/shmat).
+ *
+ * A segment's pages have one page table entry each, kept in the
+ * segment rather than in any address space, so every process that
+ * attaches it finds the same frame or swap slot there. Attaching adds
+ * an mmap-style region whose as_shm points at the segment.
+ *
+ * The frames of a segment have cm_shm set instead of cm_as, and
+ * cm_pte->pt_vas is the page's offset into the segment. Together with
+ * the sg_attach list that is the reverse map eviction uses to find
+ * every TLB entry a frame may have, at any address in any process.
+ *
+ * MAP_SHARED mappings are segments too, made by shm_mmap rather than
+ * shmget and found in no table, so a forked child (or another process
+ * mapping the same file) reaches the very same frames. A file has at
+ * most one such segment, whose page i is page i of the file; pages of
+ * it are read in from the file on first touch and written back once,
+ * when the last mapping goes away.
+ *
+ * A region on a segment has as_shm set and as_fileva the address at
+ * which the start of the segment would be; that is also the sa_vbase
+ * of its attachment. Every region counts as one attachment, so munmap
+ * can split a mapping like any other.
+ */
+
+#include <types.h>
+
+struct addrspace;
+struct lock;
+struct pageTableNode;
+struct vnode;
+
+struct shm_attach {
+	struct addrspace *sa_as;
+	vaddr_t sa_vbase;
+	struct shm_attach *sa_next;
+};
+
+struct shm_segment {
+	int sg_key;
+	unsigned sg_npages;
+	unsigned sg_nattach;            /* attachments, under shm_lock */
+	bool sg_removed;                /* IPC_RMID: gone at the last detach */
+	bool sg_mmap;                   /* made by shm_mmap, not shmget */
+	struct vnode *sg_vnode;         /* file behind a MAP_SHARED mapping */
+	off_t sg_filesize;              /* bytes of it the mappings cover */
+	struct lock *sg_lock;           /* held by faults on its pages */
+	struct pageTableNode **sg_pages; /* NULL until first touched */
+	struct shm_attach *sg_attach;   /* under cm_lock, for eviction */
+	struct shm_segment *sg_next;    /* file segments, under shm_lock */
+};
+
+#define SHM_MAXSEGS   32              /* segments in the system */
+#define SHM_MAXPAGES  1024            /* pages in one segment */
+#define SHM_MMAPPAGES 65536           /* pages of a MAP_SHARED segment */
+
+void shm_bootstrap(void);
+
+int shm_get(int key, size_t size, int flags, int *ret);
+int shm_attach(int id, struct addrspace *as, int flags, vaddr_t *ret);
+int shm_mmap(struct addrspace *as, size_t npages, int prot, struct vnode *vn,
+	     off_t offset, size_t filesize, vaddr_t *ret);
+int shm_fork(struct shm_segment *seg, struct addrspace *as, vaddr_t vbase);
+struct pageTableNode *shm_page(struct shm_segment *seg, unsigned index);
+void shm_detach(struct shm_segment *seg, struct addrspace *as, vaddr_t vbase);
+int shm_remove(int id);
+
+#endif /* _SHM_H_ */
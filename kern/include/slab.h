@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches (slab.c).
+ *
+ * A cache hands out objects of one type from whole pages ("slabs")
+ * kept for that type, instead of rounding each one up to a kmalloc
+ * bucket. If the cache has a constructor, objects are constructed
+ * once when their slab is made and handed out still constructed: the
+ * caller must give them back in that state (locks unheld, and so on),
+ * and the destructor only runs when the slab itself is released.
+ *
+ *    kmem_cache_create  - make a cache of SIZE-byte objects. CTOR
+ *                         returns 0 or an error; CTOR and DTOR may be
+ *                         NULL. NAME is not copied. Panics on failure,
+ *                         as caches are made at boot.
+ *
+ *    kmem_cache_alloc   - return an object, or NULL if out of memory.
+ *
+ *    kmem_cache_free    - give an object back.
+ *
+ *    kmem_cache_printstats - print one cache's usage.
+ *
+ *    kmem_cache_printall - print every cache (kheap_printstats).
+ *
+ *    kmem_cache_idleall - bytes of slab pages holding no allocated
+ *                         object, which kheap_getused does not count.
+ *
+ * Both alloc and free may move a page to or from the coremap, so they
+ * must not be called with cm_lock held. Constructors and destructors
+ * run without the cache's lock and may sleep, and so then may alloc
+ * and free.
+ */
+
+#include <types.h>
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     int (*ctor)(void *obj),
+                                     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(struct kmem_cache *kc);
+void kmem_cache_printall(void);
+unsigned long kmem_cache_idleall(void);
+
+#endif /* _SLAB_H_ */
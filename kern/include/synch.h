@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the object caches locks and CVs come from. Called early in
+ * boot, before anything creates a lock.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -94,6 +94,8 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Run queue level (see cpu.h) */
+	unsigned t_ticks;		/* Hardclocks used at this level */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
 	/*
@@ -171,15 +173,17 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread a hardclock and switch if its quantum is
+ * used up or a higher-priority thread is waiting. Called from the
+ * timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Switch if an interrupt has made a higher-priority thread runnable.
+ * Called on the way out of every interrupt.
  */
-void thread_consider_migration(void);
+void thread_preempt(void);
 
 extern unsigned thread_count;
 void thread_wait_for_count(unsigned);
@@ -43,12 +43,35 @@
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
-#define VM_STACKPAGES    1024//stacktest need 200 * 4KB stack
+#define VM_STACKPAGES    1024//default stack rlimit; stacktest need 200 * 4KB stack
 
 # define SWAP_FILENAME "lhd0raw:"
+# define SWAP_CLUSTER 8 //max pages per swap read/write request
+# define SWAP_RUN 32 //swap slots an address space reserves at a time
+# define FAULT_AROUND 8 //aligned block of pages mapped around a fault
+# define FAULT_AHEAD_MAX 8 //pages brought in ahead of a sequential run
 
 enum cm_status_t { Fixed, Clean, Dirty, Free};
 
+/*
+ * Page replacement policies for swap_out: evict the page with the
+ * oldest cm_sec fault time, or second-chance clock on cm_ref.
+ */
+enum vm_policy_t { VM_POLICY_SEC, VM_POLICY_CLOCK, VM_POLICY_COUNT };
+
+struct shm_segment;
+struct pageref;
+
+/*
+ * A mapping of a frame shared copy-on-write after fork, besides the one
+ * in cm_pte/cm_as. Protected by cm_lock.
+ */
+struct cow_link {
+    struct addrspace *cl_as;
+    struct pageTableNode *cl_pte;
+    struct cow_link *cl_next;
+};
+
 struct coremap_entry{
     enum cm_status_t cm_status;
     /*
@@ -57,24 +80,52 @@ struct coremap_entry{
     */
     // size_t cm_size;
     unsigned cm_len;
+    /*
+    *cm_refcount is the number of page table entries mapping a user frame.
+    *Frames shared copy-on-write after fork have cm_refcount > 1 and are not
+    *swapped out while shared; cm_cow lists the mappings other than cm_pte,
+    *and whichever is left last owns the frame again. The shared zero frame
+    *is Fixed and holds one extra reference of its own.
+    */
+    unsigned cm_refcount;
     pid_t cm_pid;
     bool cm_isbusy;
     bool cm_intlb;
     time_t cm_sec;
+    bool cm_ref;        //referenced since the clock hand last passed
+    bool cm_zeroed;     //free and known to be all zero (on the zeroed list)
+    struct pageref * cm_pageref;    //kmalloc's record of a subpage heap page, else NULL
     struct pageTableNode * cm_pte;
+    struct addrspace * cm_as;   //address space cm_pte belongs to
+    struct shm_segment * cm_shm;    //or shared segment (see shm.h); cm_as is NULL
+    struct cow_link * cm_cow;   //the other copy-on-write mappings, if shared
+    uint32_t cm_tlbcpus;        //cpus that still have to drop it from their TLB
+    /*
+    *free list links (coremap indices). Frame 0 holds the exception handlers
+    *and is never free, so index 0 terminates the list.
+    */
+    unsigned cm_next;
+    unsigned cm_prev;
     // int cm_fifo;
     //cm_pid
 };
 
 paddr_t cm_addr;//extern
 unsigned cm_num;
+extern unsigned cm_freehead;
+extern unsigned cm_nfree;
 
 bool vm_swapenabled;
 
 struct coremap_entry * coremap;//extern
 struct bitmap * vm_bitmap;
 struct lock * swap_lock;
-struct wchan * cm_wchan;
+/*
+ * cm_lock protects the coremap, the free list, the swap map and the
+ * state fields of page table entries. It is only held for short
+ * updates: zeroing, copying, kmalloc and page table walks happen with
+ * it released, and a frame being worked on is marked cm_isbusy instead.
+ */
 extern struct spinlock cm_lock;
 /* Initialization function */
 void vm_bootstrap(void);
@@ -95,16 +146,73 @@ unsigned int coremap_used_bytes(void);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown_all(void);
+
+/* TLB address space IDs (as_activate and page table changes) */
+void vm_asid_activate(struct addrspace *as);
+void vm_asid_retire(struct addrspace *as);
+void vm_tlb_unmap(struct addrspace *as, vaddr_t vaddr, unsigned npages);
 
 void cm_init(void);
 
+/* Called without cm_lock; returns a zeroed frame with no cm_pte yet */
 vaddr_t user_alloc_onepage(void);
 
 void user_free_onepage(vaddr_t addr);
 
+void user_release_page(struct pageTableNode * pte);
+
+/*
+ * Sharing a page with a forked copy (as_copy). cow_link_get is called
+ * without cm_lock and may return NULL; the rest with cm_lock held.
+ * vm_cow_share uses up LINK either way.
+ */
+struct cow_link *cow_link_get(void);
+void cow_link_put(struct cow_link * link);
+void vm_cow_share(struct addrspace * as, struct pageTableNode * pte,
+		  struct pageTableNode * from, struct cow_link * link);
+void vm_swap_share(struct pageTableNode * pte, struct pageTableNode * from);
+
+/* Write a page of a shared file mapping back; called without cm_lock */
+struct regionInfoNode;
+int vm_writeback(struct regionInfoNode * ri, struct pageTableNode * pte);
+
 int block_write(void * buffer, off_t offset);
 
 int block_read(void * buffer, off_t offset);
 
-void wait_page_if_busy(unsigned index);
+void wait_page_if_busy(struct pageTableNode * pte);
+
+void wakeup_page(unsigned index);
+
+/* Replacement policy selection and fault/eviction statistics (vmstat) */
+int vm_setpolicy(const char *name);
+void vm_printstats(void);
+void vm_resetstats(void);
+
+/* Refill the pre-zeroed frame pool from the idle loop (thread_switch) */
+bool vm_idlezero(void);
+
+/* Pageout daemon watermarks, in free frames (vmwm) */
+int vm_setwatermarks(unsigned low, unsigned high);
+
+/* Stack rlimit for new address spaces, in pages (vmstack) */
+extern unsigned vm_stacklimit;
+int vm_setstacklimit(unsigned npages);
+
+/* Swap usage (swapstat); vm_swap_release drops an address space's run */
+void vm_printswapstats(void);
+void vm_swap_release(struct addrspace *as);
+
+/*
+ * Page table entries of swapped-out pages: vm_pt_reclaim frees them,
+ * leaving their swap slots in the page table, and folds second-level
+ * tables that are left with nothing else (pt_fold); vm_pt_expand restores
+ * the one for VADDR (and the run swapped out after it). Both are called
+ * with as_lock held and cm_lock not held. vm_swap_drop frees the slot
+ * of a reclaimed entry that goes away; called with cm_lock held.
+ */
+unsigned vm_pt_reclaim(struct addrspace *as);
+int vm_pt_expand(struct addrspace *as, vaddr_t vaddr);
+void vm_swap_drop(struct pageTableNode *entry);
 #endif /* _VM_H_ */
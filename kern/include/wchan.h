@@ -38,6 +38,12 @@
 struct spinlock; /* in spinlock.h */
 struct wchan; /* Opaque */
 
+/*
+ * Set up the object cache wait channels come from. Called early in
+ * boot, before anything creates a wait channel.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -42,11 +42,14 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <file_syscall.h>
+#include <proc_syscall.h>
 #include <test.h>
 #include <kern/test161.h>
 #include <version.h>
@@ -110,7 +113,11 @@ boot(void)
 	ram_bootstrap();
     //coremap init
     cm_init();
+	synch_bootstrap();
+	wchan_bootstrap();
+	fileHandle_bootstrap();
 	proc_bootstrap();
+	proc_syscall_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
@@ -50,6 +50,7 @@
 #include "opt-automationtest.h"
 #include <proc_syscall.h>
 #include <current.h>
+#include <vm.h>
 #include <types.h>
 
 
@@ -531,6 +532,71 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_resetstats();
+	}
+	else {
+		kprintf("Usage: vmstat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs != 2 || vm_setpolicy(args[1])) {
+		kprintf("Usage: vmpolicy sec|clock\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmwatermarks(int nargs, char **args)
+{
+	if (nargs != 3 ||
+	    vm_setwatermarks(atoi(args[1]), atoi(args[2]))) {
+		kprintf("Usage: vmwm lowfree highfree\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmstacklimit(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("stack rlimit: %u pages\n", vm_stacklimit);
+	}
+	else if (nargs != 2 || vm_setstacklimit(atoi(args[1]))) {
+		kprintf("Usage: vmstack [pages]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printswapstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -598,6 +664,7 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[km6] kmalloc throughput test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -682,6 +749,11 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM fault/eviction stats    ",
+	"[vmpolicy] Set page replacement     ",
+	"[vmwm] Set pageout watermarks       ",
+	"[vmstack] Set stack rlimit (pages)  ",
+	"[swapstat] Swap usage               ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -737,6 +809,11 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstats },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "vmwm",       cmd_vmwatermarks },
+	{ "vmstack",    cmd_vmstacklimit },
+	{ "swapstat",   cmd_swapstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -748,6 +825,7 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -50,6 +50,7 @@
 #include <vnode.h>
 #include <thread.h>
 #include <kern/errno.h>
+#include <slab.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -57,6 +58,7 @@
 struct proc *kproc;
 struct proc *procTable[PID_MAX];
 static struct spinlock procTable_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *proc_cache;
 
 /*
  * Create a proc structure.
@@ -67,13 +69,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		proc_free(proc);
 		return NULL;
 	}
 
@@ -82,6 +84,11 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_faultsavoided = 0;
+	proc->p_minflt = 0;
+	proc->p_majflt = 0;
+	proc->p_cminflt = 0;
+	proc->p_cmajflt = 0;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -89,14 +96,14 @@ proc_create(const char *name)
 	proc->p_lk = lock_create("proc lock");
 	if(proc->p_lk == NULL){
 		kfree(proc->p_name);
-		kfree(proc);
+		proc_free(proc);
 		return NULL;
 	}
 	proc->p_cv = cv_create("proc cv");
 	if(proc->p_cv == NULL){
-		kfree(proc->p_name);
-		kfree(proc);
 		lock_destroy(proc->p_lk);
+		kfree(proc->p_name);
+		proc_free(proc);
 		return NULL;
 	}
 
@@ -111,9 +118,11 @@ proc_create(const char *name)
 		i++;
 	}
 	if(i == PID_MAX){
-		kfree(proc->p_name);
-		kfree(proc);
 		spinlock_release(&procTable_lock);
+		cv_destroy(proc->p_cv);
+		lock_destroy(proc->p_lk);
+		kfree(proc->p_name);
+		proc_free(proc);
 		return NULL;//ENPROC/EMPROC
 	}
 
@@ -222,18 +231,54 @@ proc_destroy(struct proc *proc)
 	lock_destroy(proc->p_lk);
 	cv_destroy(proc->p_cv);
 	proc->p_thread = NULL;
-	procTable[proc->p_PID] = NULL;
+	proc_unlist(proc);
 	kfree(proc->p_name);
-	kfree(proc);
+	proc_free(proc);
 	proc = NULL;
 }
 
+/*
+ * Give a proc structure back once everything in it is released.
+ */
+void
+proc_free(struct proc *proc)
+{
+	kmem_cache_free(proc_cache, proc);
+}
+
+void
+proc_unlist(struct proc *proc)
+{
+	spinlock_acquire(&procTable_lock);
+	KASSERT(procTable[proc->p_PID] == proc);
+	procTable[proc->p_PID] = NULL;
+	spinlock_release(&procTable_lock);
+}
+
+void
+proc_printstats(void)
+{
+	struct proc *p;
+
+	kprintf("%5s %-16s %14s\n", "pid", "name", "faultsavoided");
+	spinlock_acquire(&procTable_lock);
+	for(int i = PID_MIN; i < PID_MAX; i++){
+		p = procTable[i];
+		if(p != NULL && p != kproc){
+			kprintf("%5d %-16s %14lu\n", (int)p->p_PID, p->p_name,
+				p->p_faultsavoided);
+		}
+	}
+	spinlock_release(&procTable_lock);
+}
+
 /*
  * Create the process structure for the kernel.
  */
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL, NULL);
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -14,13 +14,48 @@
 #include <copyinout.h>
 #include <kern/stat.h>
 #include <kern/seek.h>
+#include <slab.h>
 
 
+/*
+ * File handles come from an object cache whose objects keep their lock
+ * from one use to the next, so opening a file creates no lock.
+ */
+static struct kmem_cache *fileHandle_cache;
+
+static
 int
-fileHandle_init(char * filename, struct vnode *vn, struct fileHandle ** fh, off_t offset, int flags, int refcount)
+fileHandle_ctor(void *obj)
+{
+	struct fileHandle *fh = obj;
+
+	fh->lk = lock_create("fileHandle");
+	if(fh->lk == NULL){
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+fileHandle_dtor(void *obj)
+{
+	struct fileHandle *fh = obj;
+
+	lock_destroy(fh->lk);
+}
+
+void
+fileHandle_bootstrap(void)
 {
-	fh[0] = (struct fileHandle *)kmalloc(sizeof(struct fileHandle));
-	// KASSERT(fh != NULL);
+	fileHandle_cache = kmem_cache_create("fileHandle",
+		sizeof(struct fileHandle), fileHandle_ctor, fileHandle_dtor);
+}
+
+int
+fileHandle_init(struct vnode *vn, struct fileHandle ** fh, off_t offset, int flags, int refcount)
+{
+	fh[0] = kmem_cache_alloc(fileHandle_cache);
 	if(fh[0] == NULL){
 		return ENFILE;
 	}
@@ -28,10 +63,16 @@ fileHandle_init(char * filename, struct vnode *vn, struct fileHandle ** fh, off_
 	fh[0]->flags = flags;
 	fh[0]->offset = offset;
 	fh[0]->refcount = refcount;
-	fh[0]->lk = lock_create(filename);
 	return 0;
 }
 
+void
+fileHandle_free(struct fileHandle *fh)
+{
+	KASSERT(!lock_do_i_hold(fh->lk));
+	kmem_cache_free(fileHandle_cache, fh);
+}
+
 int
 fileTable_init(void)
 {
@@ -53,7 +94,7 @@ fileTable_init(void)
 		vfs_close(v0);
 		return EINVAL;
 	}
-	if(fileHandle_init(console, v0, &curproc->fileTable[0], 0, O_RDONLY, 1)){
+	if(fileHandle_init(v0, &curproc->fileTable[0], 0, O_RDONLY, 1)){
 		kfree(console);
 		kfree(console1);
 		kfree(console2);
@@ -65,21 +106,19 @@ fileTable_init(void)
 		kfree(console);
 		kfree(console1);
 		kfree(console2);
-		lock_destroy(curproc->fileTable[0]->lk);
-		kfree(curproc->fileTable[0]);
+		fileHandle_free(curproc->fileTable[0]);
 		vfs_close(v0);
 		vfs_close(v1);
 		return EINVAL;
 	}
-	if(fileHandle_init(console1, v1, &curproc->fileTable[1], 0, O_WRONLY, 1)){
+	if(fileHandle_init(v1, &curproc->fileTable[1], 0, O_WRONLY, 1)){
 		// kfree(v0);
 		// kfree(v1);
 		// kfree(v2);
 		kfree(console);
 		kfree(console1);
 		kfree(console2);
-		lock_destroy(curproc->fileTable[0]->lk);
-		kfree(curproc->fileTable[0]);
+		fileHandle_free(curproc->fileTable[0]);
 		vfs_close(v0);
 		vfs_close(v1);
 		return ENFILE;
@@ -89,24 +128,20 @@ fileTable_init(void)
 		kfree(console);
 		kfree(console1);
 		kfree(console2);
-		lock_destroy(curproc->fileTable[0]->lk);
-		kfree(curproc->fileTable[0]);
-		lock_destroy(curproc->fileTable[1]->lk);
-		kfree(curproc->fileTable[1]);
+		fileHandle_free(curproc->fileTable[0]);
+		fileHandle_free(curproc->fileTable[1]);
 		vfs_close(v0);
 		vfs_close(v1);
 		vfs_close(v2);
 		return EINVAL;
 	}
 
-	if(fileHandle_init(console2, v2, &curproc->fileTable[2], 0, O_WRONLY, 1)){
+	if(fileHandle_init(v2, &curproc->fileTable[2], 0, O_WRONLY, 1)){
 		kfree(console);
 		kfree(console1);
 		kfree(console2);
-		lock_destroy(curproc->fileTable[0]->lk);
-		kfree(curproc->fileTable[0]);
-		lock_destroy(curproc->fileTable[1]->lk);
-		kfree(curproc->fileTable[1]);
+		fileHandle_free(curproc->fileTable[0]);
+		fileHandle_free(curproc->fileTable[1]);
 		vfs_close(v0);
 		vfs_close(v1);
 		vfs_close(v2);
@@ -144,7 +179,7 @@ sys_open(const char * filename, int flags, int * retval)
 		kfree(name);
 		return EINVAL;
 	}
-	if(fileHandle_init(name, v, &curproc->fileTable[index], 0, flags, 1)){
+	if(fileHandle_init(v, &curproc->fileTable[index], 0, flags, 1)){
 		vfs_close(v);
 		kfree(name);
 		curproc->fileTable[index] = NULL;
@@ -256,8 +291,7 @@ sys_close(int fd){
 		vfs_close(curproc->fileTable[fd]->vn);
 		lock_release(curproc->fileTable[fd]->lk);
 		// vnode_cleanup(curproc->fileTable[fd]->vn);
-		lock_destroy(curproc->fileTable[fd]->lk);
-		kfree(curproc->fileTable[fd]);
+		fileHandle_free(curproc->fileTable[fd]);
 		curproc->fileTable[fd] = NULL;
 	}
 	return 0;
@@ -354,22 +388,10 @@ sys_dup2(int oldfd, int newfd, int * retval){
 		*retval = newfd;
 		return 0;
 	}
-	lock_acquire(curproc->fileTable[oldfd]->lk);
-	if(curproc->fileTable[newfd] == NULL){
-		curproc->fileTable[newfd] = (struct fileHandle *)kmalloc(sizeof(struct fileHandle));
-		// KASSERT(fh != NULL);
-		if(curproc->fileTable[newfd] == NULL){
-			return ENFILE;
-		}
-	}else{
+	if(curproc->fileTable[newfd] != NULL){
 		sys_close(newfd);
-		if(curproc->fileTable[newfd] == NULL){
-			curproc->fileTable[newfd] = (struct fileHandle *)kmalloc(sizeof(struct fileHandle));
-			if(curproc->fileTable[newfd] == NULL){
-				return ENFILE;
-			}
-		}
 	}
+	lock_acquire(curproc->fileTable[oldfd]->lk);
 	curproc->fileTable[newfd] = curproc->fileTable[oldfd];
 	curproc->fileTable[oldfd]->refcount++;
 	*retval = newfd;
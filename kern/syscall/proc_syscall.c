@@ -11,9 +11,17 @@
 #include <syscall.h>
 #include <kern/wait.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/shm.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <shm.h>
+#include <kern/stat.h>
+#include <file_syscall.h>
 #include <vfs.h>
 #include <vm.h>
 #include <bitmap.h>
+#include <slab.h>
 
 int
 sys_getpid(pid_t * retval){
@@ -21,10 +29,22 @@ sys_getpid(pid_t * retval){
     return 0;
 }
 
+/*
+ * A forked child's trapframe, handed to enter_forked_process, which
+ * frees it once copied to the child's stack.
+ */
+struct kmem_cache *trapframe_cache;
+
+void
+proc_syscall_bootstrap(void){
+    trapframe_cache = kmem_cache_create("trapframe", sizeof(struct trapframe),
+                                        NULL, NULL);
+}
+
 int sys_fork(struct trapframe * tf, int * retval){
     //copy parent's tf to child's new trapframe
     struct trapframe * newtf = NULL;
-    newtf = (struct trapframe *)kmalloc(sizeof(struct trapframe));
+    newtf = kmem_cache_alloc(trapframe_cache);
     if(newtf == NULL){
         return ENOMEM;
     }
@@ -35,7 +55,7 @@ int sys_fork(struct trapframe * tf, int * retval){
     int result = 0;
     result = as_copy(curproc->p_addrspace, &newas);//no need for as_create
     if(result){
-        kfree(newtf);
+        kmem_cache_free(trapframe_cache, newtf);
         return ENOMEM;
     }
 
@@ -43,7 +63,7 @@ int sys_fork(struct trapframe * tf, int * retval){
     struct proc * newproc = NULL;
     newproc = proc_create_runprogram("child");
     if(newproc == NULL){
-        kfree(newtf);
+        kmem_cache_free(trapframe_cache, newtf);
         as_destroy(newas);//now same as kfree(newas)
         return ENOMEM;
     }
@@ -110,15 +130,18 @@ int sys_waitpid(pid_t pid, int * status, int options, pid_t *retval) {
 
         *status = p->p_exitcode;
     }
-    as_destroy(p->p_addrspace);
+    //the child gave up its address space in sys__exit
+    KASSERT(p->p_addrspace == NULL);
+    curproc->p_cminflt += p->p_minflt + p->p_cminflt;
+    curproc->p_cmajflt += p->p_majflt + p->p_cmajflt;
     lock_destroy(p->p_lk);
     spinlock_cleanup(&p->p_lock);
     cv_destroy(p->p_cv);
     p->p_addrspace = NULL;
     p->p_thread = NULL;
+    proc_unlist(p);
     kfree(p->p_name);
-    procTable[p->p_PID] = NULL;
-    kfree(p);
+    proc_free(p);
     p = NULL;
 	*retval = pid;
 	return 0;
@@ -138,20 +161,27 @@ void sys__exit(int exitcode, bool trap_sig) {
     for (int fd = 0; fd < OPEN_MAX; fd++) {
         sys_close(fd);
     }
+    /*
+     * A zombie needs no address space. Unhook it before the parent
+     * can see p_exit: once waitpid may free us, switching back in
+     * before thread_exit must not activate an address space that is
+     * gone.
+     */
+    as_destroy(proc_setas(NULL));
+    as_deactivate();
     if(procTable[p->p_PPID] != NULL && procTable[p->p_PPID]->p_exit == false){
         cv_broadcast(p->p_cv, p->p_lk);
         lock_release(p->p_lk);
     }else{
         lock_release(p->p_lk);
-        as_destroy(p->p_addrspace);
         lock_destroy(p->p_lk);
         spinlock_cleanup(&p->p_lock);
         cv_destroy(p->p_cv);
         p->p_addrspace = NULL;
         p->p_thread = NULL;
+        proc_unlist(p);
         kfree(p->p_name);
-        procTable[curproc->p_PID] = NULL;
-        kfree(p);
+        proc_free(p);
         p = NULL;
     }
     thread_exit();
@@ -269,7 +299,8 @@ sys_execv(const char * program, char ** args){
     if (result) {
         return result;
     }
-    as_destroy(curproc->p_addrspace);
+    //unhook it first: a context switch would reactivate it
+    as_destroy(proc_setas(NULL));
     as = as_create();
     if (as == NULL) {
         vfs_close(v);
@@ -328,61 +359,166 @@ sys_sbrk(int amount, vaddr_t * retval){
         return EINVAL;
     }
 
-    if(amount + heap_vbound * PAGE_SIZE >= USERSTACK - VM_STACKPAGES * PAGE_SIZE){
-        kprintf("sbrk bound exceeds stackbase\n");
+    //the heap may grow up to the lowest mmap region, or to the guard
+    //page below however far the stack has grown
+    if(amount > 0 && as->heap_vbase + heap_vbound * PAGE_SIZE + amount > as_heap_limit(as)){
+        kprintf("sbrk bound exceeds mmap or stack base\n");
         return ENOMEM;
     }
 
 
     if(npages < 0 && as->pageTable != NULL){
-        bool cm_lk_hold_before = false;
-    	if(!spinlock_do_i_hold(&cm_lock)){
-    		spinlock_acquire(&cm_lock);
-    	}else{
-    		cm_lk_hold_before = true;
-    	}
+        lock_acquire(as->as_lock);
 
-        //destroy pte
-        struct pageTableNode * pre = as->pageTable;
-        struct pageTableNode * cur = pre->next;
-        while(cur != NULL){
-            wait_page_if_busy(cur->pt_pas / PAGE_SIZE);
-
-            if(cur->pt_vas >= as->heap_vbase + (as->heap_vbound + npages) * PAGE_SIZE && cur->pt_vas < as->heap_vbase + as->heap_vbound * PAGE_SIZE){
-                pre->next = cur->next;
-                if(cur->pt_inDisk){
-                    bitmap_unmark(vm_bitmap, cur->pt_bm_index);
-                }else{
-                    user_free_onepage(PADDR_TO_KVADDR(cur->pt_pas));
-                }
-        		kfree(cur);
-                cur = pre->next;
-            }else{
-                pre = cur;
-                cur = cur->next;
-            }
-        }
-        // head
-        pre = as->pageTable;
-        cur = pre->next;
-        wait_page_if_busy(pre->pt_pas / PAGE_SIZE);
-        if(pre->pt_vas >= as->heap_vbase + (as->heap_vbound + npages) * PAGE_SIZE && pre->pt_vas < as->heap_vbase + as->heap_vbound * PAGE_SIZE){
-            if(pre->pt_inDisk){
-                bitmap_unmark(vm_bitmap, pre->pt_bm_index);
-            }else{
-                user_free_onepage(PADDR_TO_KVADDR(pre->pt_pas));
-            }
-            kfree(pre);
-            as->pageTable = cur;
-        }
-        as_activate();
+        //destroy pte in [new break, old break)
+        vaddr_t vstart = as->heap_vbase + (as->heap_vbound + npages) * PAGE_SIZE;
+        vaddr_t vend = as->heap_vbase + as->heap_vbound * PAGE_SIZE;
+        pt_release_range(as, vstart, vend);
 
-        if(!cm_lk_hold_before){
-    		spinlock_release(&cm_lock);
-    	}
+        lock_release(as->as_lock);
     }
     *retval = as->heap_vbase + as->heap_vbound * PAGE_SIZE;
     as->heap_vbound += npages;
 
     return 0;
 }
+
+/*
+ * ADDR is only a hint and is ignored; the mapping goes below the lowest
+ * existing one. File pages are read in on first touch, straight into
+ * the user's frame. MAP_SHARED mappings are shared memory segments
+ * (see shm.h), so whoever else maps the same pages, by fork or by
+ * mapping the file, sees the same frames.
+ */
+int
+sys_mmap(void * addr, size_t len, int prot, int flags, int fd, off_t offset, vaddr_t * retval){
+    struct addrspace * as = curproc->p_addrspace;
+    struct fileHandle * fh;
+    struct vnode * vn = NULL;
+    struct stat st;
+    size_t filesize = 0;
+    int mode, result;
+
+    (void)addr;
+    *retval = (vaddr_t)MAP_FAILED;
+    if(len == 0 || len > USERSTACK || offset < 0 || offset % PAGE_SIZE != 0){
+        return EINVAL;
+    }
+    if((flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+       ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)){
+        return EINVAL;
+    }
+    if((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0){
+        return EINVAL;
+    }
+
+    if(!(flags & MAP_ANON)){
+        if(fd < 0 || fd >= OPEN_MAX || curproc->fileTable[fd] == NULL){
+            return EBADF;
+        }
+        fh = curproc->fileTable[fd];
+        mode = fh->flags & O_ACCMODE;
+        if(mode == O_WRONLY){
+            return EACCES;
+        }
+        if((flags & MAP_SHARED) && (prot & PROT_WRITE) && mode != O_RDWR){
+            return EACCES;
+        }
+        vn = fh->vn;
+        result = VOP_MMAP(vn);
+        if(result){
+            return result;
+        }
+        result = VOP_STAT(vn, &st);
+        if(result){
+            return result;
+        }
+        //pages past the end of the file are zero and never written back
+        if(st.st_size > offset){
+            filesize = st.st_size - offset < (off_t)len ? st.st_size - offset : len;
+        }else{
+            vn = NULL;
+        }
+    }
+
+    if(flags & MAP_SHARED){
+        return shm_mmap(as, (len + PAGE_SIZE - 1) / PAGE_SIZE, prot,
+                        vn, offset, filesize, retval);
+    }
+    return as_define_mmap(as, (len + PAGE_SIZE - 1) / PAGE_SIZE, prot, flags,
+                          vn, offset, filesize, retval);
+}
+
+int
+sys_munmap(vaddr_t addr, size_t len){
+    if(addr % PAGE_SIZE != 0 || len == 0 || len > USERSTACK){
+        return EINVAL;
+    }
+    return as_unmap(curproc->p_addrspace, addr, (len + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+int
+sys_shmget(int key, size_t size, int flags, int * retval){
+    if((flags & ~(IPC_CREAT | IPC_EXCL | 0777)) != 0){
+        return EINVAL;
+    }
+    return shm_get(key, size, flags, retval);
+}
+
+int
+sys_shmat(int id, const void * addr, int flags, vaddr_t * retval){
+    //like mmap, the kernel picks the address
+    (void)addr;
+    *retval = (vaddr_t)-1;
+    if((flags & ~SHM_RDONLY) != 0){
+        return EINVAL;
+    }
+    return shm_attach(id, curproc->p_addrspace, flags, retval);
+}
+
+int
+sys_shmdt(vaddr_t addr){
+    struct addrspace * as = curproc->p_addrspace;
+    struct shm_segment * seg;
+    int result;
+
+    result = as_detach_shm(as, addr, &seg);
+    if(result){
+        return result;
+    }
+    shm_detach(seg, as, addr);
+    return 0;
+}
+
+int
+sys_shmctl(int id, int cmd, userptr_t buf){
+    //no shmid_ds: IPC_RMID is the only command
+    (void)buf;
+    if(cmd != IPC_RMID){
+        return EINVAL;
+    }
+    return shm_remove(id);
+}
+
+/*
+ * Only the fault counts are kept; everything else reads as zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage){
+    struct rusage ru;
+
+    bzero(&ru, sizeof(ru));
+    switch(who){
+    case RUSAGE_SELF:
+        ru.ru_minflt = curproc->p_minflt;
+        ru.ru_majflt = curproc->p_majflt;
+        break;
+    case RUSAGE_CHILDREN:
+        ru.ru_minflt = curproc->p_cminflt;
+        ru.ru_majflt = curproc->p_cmajflt;
+        break;
+    default:
+        return EINVAL;
+    }
+    return copyout(&ru, usage, sizeof(ru));
+}
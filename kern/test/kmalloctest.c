@@ -37,6 +37,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <clock.h>
 #include <test.h>
 #include <kern/test161.h>
 #include <mainbus.h>
@@ -605,3 +606,111 @@ kmalloctest5(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * kmalloc throughput. For 1, 2, 4, ... threads, up to the number of
+ * cpus, each thread does a number of kmalloc/kfree pairs (the argument,
+ * default KM6_PAIRS) cycling through the subpage sizes. Each thread
+ * keeps its last KM6_LIVE blocks, so a free does not just undo the
+ * allocation before it. Prints operations per second for each thread
+ * count; with per-cpu caches in kmalloc these should scale with the
+ * thread count rather than queue on one lock.
+ *
+ * Only the number of threads varies. They are not bound to cpus; the
+ * scheduler spreads them over however many the machine has, so run it
+ * with enough cpus for the largest count.
+ */
+
+#define KM6_PAIRS 20000
+#define KM6_LIVE  16
+
+static
+void
+km6thread(void *sm, unsigned long npairs)
+{
+	struct semaphore *sem = sm;
+	void *live[KM6_LIVE];
+	unsigned long i;
+	unsigned slot;
+
+	for (slot = 0; slot < KM6_LIVE; slot++) {
+		live[slot] = NULL;
+	}
+	for (i = 0; i < npairs; i++) {
+		slot = i % KM6_LIVE;
+		kfree(live[slot]);
+		/* 12 .. 1020 bytes: every subpage size but the largest */
+		live[slot] = kmalloc((16 << (i % 7)) - 4);
+		if (live[slot] == NULL) {
+			panic("km6: kmalloc failed\n");
+		}
+		*(unsigned long *)live[slot] = i;
+	}
+	for (slot = 0; slot < KM6_LIVE; slot++) {
+		kfree(live[slot]);
+	}
+	V(sem);
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before, after;
+	unsigned long npairs = KM6_PAIRS, msecs, ops;
+	unsigned n, i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("usage: km6 [pairs-per-thread]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		npairs = atoi(args[1]);
+	}
+
+	sem = sem_create("km6", 0);
+	if (sem == NULL) {
+		panic("km6: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc throughput test (threads not bound to "
+		"any of the %u cpus)...\n", num_cpus);
+	for (n = 1; ; n *= 2) {
+		if (n > num_cpus) {
+			n = num_cpus;
+		}
+		gettime(&before);
+		for (i = 0; i < n; i++) {
+			result = thread_fork("km6", NULL, km6thread, sem, npairs);
+			if (result) {
+				panic("km6: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i = 0; i < n; i++) {
+			P(sem);
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &after);
+
+		msecs = after.tv_sec * 1000 + after.tv_nsec / 1000000;
+		if (msecs == 0) {
+			msecs = 1;
+		}
+		ops = n * npairs * 2;
+		kprintf("km6: %u thread(s): %lu ops in %lu ms, %lu ops/sec\n",
+			n, ops, msecs,
+			(unsigned long)((uint64_t)ops * 1000 / msecs));
+		if (n == num_cpus) {
+			break;
+		}
+	}
+
+	sem_destroy(sem);
+	success(TEST161_SUCCESS, SECRET, "km6");
+	return 0;
+}
@@ -39,6 +39,22 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <slab.h>
+
+/*
+ * Locks and CVs come from object caches; both are made and destroyed
+ * all the time (every process has one of each, every address space a
+ * lock). synch_bootstrap must run before the first lock_create.
+ */
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock), NULL, NULL);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), NULL, NULL);
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -143,14 +159,14 @@ lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
@@ -160,7 +176,7 @@ lock_create(const char *name)
 	lock->lk_wchan = wchan_create(lock->lk_name);
 	if (lock->lk_wchan == NULL) {
 		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
@@ -179,7 +195,7 @@ lock_destroy(struct lock *lock)
 	spinlock_cleanup(&lock->lk_slk);
 	wchan_destroy(lock->lk_wchan);
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -252,14 +268,14 @@ cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = kmem_cache_alloc(cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
 
@@ -267,7 +283,7 @@ cv_create(const char *name)
 	cv->cv_wchan = wchan_create(cv->cv_name);
 	if (cv->cv_wchan == NULL) {
 		kfree(cv->cv_name);
-		kfree(cv);
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
 	spinlock_init(&cv->cv_slk);
@@ -283,7 +299,7 @@ cv_destroy(struct cv *cv)
 	spinlock_cleanup(&cv->cv_slk);
 	wchan_destroy(cv->cv_wchan);
 	kfree(cv->cv_name);
-	kfree(cv);
+	kmem_cache_free(cv_cache, cv);
 
 }
 
@@ -361,7 +377,7 @@ rwlock * rwlock_create(const char * name){
 	rwlock->rwlock_lk = lock_create(rwlock->rwlock_name);
 	if (rwlock->rwlock_lk == NULL) {
 		kfree(rwlock->rwlock_name);
-		kfree(rwlock->rwlock_cv);
+		cv_destroy(rwlock->rwlock_cv);
 		kfree(rwlock);
 		return NULL;
 	}
@@ -48,9 +48,11 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <limits.h>
+#include <slab.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -146,6 +148,8 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
 	/* Interrupt state fields */
@@ -175,6 +179,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -191,11 +196,17 @@ cpu_create(unsigned hardware_number)
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_curprio = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_stealseed = hardware_number * 2654435761U + 1;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_all = false;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -321,6 +332,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -335,9 +349,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -460,6 +478,226 @@ thread_start_cpus(void)
 	thread_count = 1;
 }
 
+/*
+ * Run queue operations. A cpu's runnable threads are spread over its
+ * SCHED_LEVELS queues by t_priority; these keep c_runcount in step.
+ * The caller holds the cpu's run queue lock.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_LEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+/*
+ * Take the first thread of the highest nonempty level, or NULL.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	unsigned i;
+
+	if (c->c_runcount == 0) {
+		return NULL;
+	}
+	for (i=0; i<SCHED_LEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			c->c_runcount--;
+			return threadlist_remhead(&c->c_runqueue[i]);
+		}
+	}
+	panic("runqueue_remhead: c_runcount is %u with no threads\n",
+	      c->c_runcount);
+}
+
+/*
+ * Take the last thread of the lowest nonempty level, or NULL. This is
+ * the one that would otherwise run last.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	unsigned i;
+
+	if (c->c_runcount == 0) {
+		return NULL;
+	}
+	for (i=SCHED_LEVELS; i-- > 0; ) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			c->c_runcount--;
+			return threadlist_remtail(&c->c_runqueue[i]);
+		}
+	}
+	panic("runqueue_remtail: c_runcount is %u with no threads\n",
+	      c->c_runcount);
+}
+
+/*
+ * Return the highest level with a thread waiting, or SCHED_LEVELS if
+ * there is none. Without the lock this is only a hint.
+ */
+static
+unsigned
+runqueue_best(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		if (c->c_runqueue[i].tl_count > 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads takes some from the peer with the
+ * most waiting: in thread_switch before it idles, and again each time
+ * an interrupt brings it out of cpu_idle. Victims are chosen from the
+ * unlocked run counts, scanning from a random cpu so ties are spread
+ * around, and only the victim's run queue lock is taken to steal.
+ *
+ * A cpu that makes a thread runnable on a busy cpu that already has
+ * one waiting kicks an idle cpu with IPI_UNIDLE so it comes and takes
+ * some, rather than leave them waiting for a quantum. This is what
+ * spreads out new threads, which start on their parent's cpu.
+ *
+ * Migrating threads isn't free because of cache affinity, but
+ * System/161 does not (yet) model such cache effects, so we steal
+ * as soon as a cpu has nothing to do.
+ */
+
+/*
+ * Per-cpu xorshift generator for picking victims; the random device
+ * is far too slow to read here.
+ */
+static
+unsigned
+thread_random(void)
+{
+	unsigned x = curcpu->c_stealseed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	curcpu->c_stealseed = x;
+	return x;
+}
+
+/*
+ * Return the peer with the most threads waiting, or NULL if none has
+ * any. The counts are read without locks, so this is only a guess.
+ */
+static
+struct cpu *
+thread_steal_victim(void)
+{
+	struct cpu *c, *victim = NULL;
+	unsigned i, start, numcpus, most = 0;
+
+	numcpus = cpuarray_num(&allcpus);
+	start = thread_random() % numcpus;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c != curcpu->c_self && c->c_runcount > most) {
+			victim = c;
+			most = c->c_runcount;
+		}
+	}
+	return victim;
+}
+
+/*
+ * Move up to half of the busiest peer's waiting threads to this cpu,
+ * taking them from the end that would run last. Called with no run
+ * queue lock held. Returns the number of threads taken.
+ */
+static
+unsigned
+thread_steal(void)
+{
+	struct cpu *victim;
+	struct threadlist stolen, skipped;
+	struct thread *t;
+	unsigned i, want, got = 0;
+
+	victim = thread_steal_victim();
+	if (victim == NULL) {
+		return 0;
+	}
+
+	threadlist_init(&stolen);
+	threadlist_init(&skipped);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	want = DIVROUNDUP(victim->c_runcount, 2);
+	for (i=0; i<want; i++) {
+		t = runqueue_remtail(victim);
+		if (t == NULL) {
+			break;
+		}
+		/*
+		 * The victim's curthread can be on its run queue: it
+		 * went to sleep, the victim idled on its stack, and it
+		 * was woken before the victim unidled. Moving it would
+		 * have two cpus on one stack, so leave it.
+		 */
+		if (t == victim->c_curthread) {
+			threadlist_addhead(&skipped, t);
+			continue;
+		}
+		t->t_cpu = curcpu->c_self;
+		threadlist_addhead(&stolen, t);
+		got++;
+	}
+	while ((t = threadlist_remhead(&skipped)) != NULL) {
+		runqueue_add(victim, t);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+	threadlist_cleanup(&skipped);
+
+	if (got > 0) {
+		DEBUG(DB_THREADS, "Stole %u threads: cpu %u -> %u",
+		      got, victim->c_number, curcpu->c_number);
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		while ((t = threadlist_remhead(&stolen)) != NULL) {
+			runqueue_add(curcpu, t);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+	threadlist_cleanup(&stolen);
+	return got;
+}
+
+/*
+ * BUSY has threads waiting; wake an idle cpu, if there is one, to
+ * steal them. Scans from a random cpu so the same one is not always
+ * picked. c_isidle is read without the lock, as a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, start, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	start = thread_random() % numcpus;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -470,6 +708,7 @@ void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
+	bool preempt;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -484,15 +723,26 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
+	preempt = target->t_priority < targetcpu->c_curprio;
+	if (targetcpu != curcpu->c_self && (targetcpu->c_isidle || preempt)) {
 		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * Other processor is idle, or running something less
+		 * important; send interrupt to make sure it unidles,
+		 * or preempts on the way out of the interrupt.
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	if (!targetcpu->c_isidle && !preempt && targetcpu->c_runcount > 1) {
+		/*
+		 * Something was already waiting and this makes another;
+		 * find one of them a cpu. A lone waiter, or one that
+		 * preempts the current thread, gets to run soon enough
+		 * where it is, and is not worth an IPI and a steal.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -537,6 +787,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = curthread->t_priority;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -620,7 +871,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
+		curcpu->c_curprio = cur->t_priority;
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -654,10 +906,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
-	 * curcpu->c_isidle must be true when cpu_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * Get the next thread. While there isn't one, try to steal
+	 * some from another cpu, then zero a free page for the VM
+	 * system, and if there is nothing to do at all call
+	 * cpu_idle(). curcpu->c_isidle must be true when cpu_idle is
+	 * called. Unlock the runqueue while stealing and idling too,
+	 * to make sure things can be added to it. Between pages,
+	 * interrupts are let in the same way cpu_idle lets them in.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -673,14 +928,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (thread_steal() == 0) {
+				if (vm_idlezero()) {
+					spl0();
+					splhigh();
+				}
+				else {
+					cpu_idle();
+				}
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	curcpu->c_curprio = next->t_priority;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -861,139 +1125,95 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue: each cpu always runs the first
+ * thread of its highest nonempty level (see cpu.h). A thread that
+ * uses a whole quantum drops a level and goes to the back, so CPU
+ * hogs sink and get longer but rarer turns, while threads that mostly
+ * sleep (the shell, anything waiting on console or disk I/O) stay
+ * near the top and run as soon as they wake.
+ *
+ * This is called from hardclock() every SCHEDULE_HARDCLOCKS.
  */
 
-void
-schedule(void)
-{
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
-
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Put everything on this cpu back at level 0, keeping the order the
+ * levels would have run in.
  */
+static
 void
-thread_consider_migration(void)
+schedule_boost(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
 	struct thread *t;
+	unsigned i;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	curthread->t_priority = 0;
+	curthread->t_ticks = 0;
+	curcpu->c_curprio = 0;
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+void
+schedule(void)
+{
+	struct thread *cur = curthread;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	/* The timer interrupted the idle loop; nothing to charge. */
+	if (curcpu->c_isidle) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if ((curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS) == 0) {
+		schedule_boost();
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+	if (++cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		cur->t_ticks = 0;
+		if (cur->t_priority < SCHED_LEVELS - 1) {
+			cur->t_priority++;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		thread_yield();
+	}
+	else if (runqueue_best(curcpu) < cur->t_priority) {
+		thread_yield();
 	}
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+/*
+ * Called on the way out of an interrupt, which may have woken a
+ * thread that outranks the current one: a device completion here,
+ * or an IPI_UNIDLE from thread_make_runnable on another cpu. Switch
+ * now rather than at the end of the quantum.
+ */
+void
+thread_preempt(void)
+{
+	if (!curcpu->c_isidle &&
+	    runqueue_best(curcpu) < curthread->t_priority) {
+		thread_yield();
 	}
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * A thread is waking up from wchan_sleep: it gave the cpu up before
+ * its quantum was over, so lift it a level.
+ */
+static
+void
+thread_wake(struct thread *target)
+{
+	if (target->t_priority > 0) {
+		target->t_priority--;
+		target->t_ticks = 0;
+	}
+	thread_make_runnable(target, false);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1002,6 +1222,19 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels come from an object cache: every lock, CV and
+ * semaphore has one.
+ */
+static struct kmem_cache *wchan_cache;
+
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					NULL, NULL);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -1015,7 +1248,7 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -1033,7 +1266,7 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1085,7 +1318,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_wake(target);
 }
 
 /*
@@ -1115,7 +1348,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wake(target);
 	}
 
 	threadlist_cleanup(&list);
@@ -1179,34 +1412,56 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned i, n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	for (i=0; i<n; i++) {
+		if (TLBSHOOTDOWN_SAME(&target->c_shootdown[i], mapping)) {
+			/* already queued */
+			break;
+		}
+	}
+	if (i < n || target->c_shootdown_all) {
+		/* nothing to add */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * Too many to do one at a time; have the target flush
+		 * its whole TLB instead.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		target->c_shootdown_all = true;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/* If an IPI is already on its way it will pick this up too. */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_mask(uint32_t cpumask, const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (cpumask & ((uint32_t)1 << c->c_number)) != 0) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1214,7 +1469,9 @@ void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	unsigned i;
+	unsigned i, numshootdown = 0;
+	bool shootdown_all = false;
+	struct tlbshootdown shootdown[TLBSHOOTDOWN_MAX];
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1243,18 +1500,30 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * Take the requests off the queue and run them after
+		 * dropping the ipi lock: vm_tlbshootdown takes VM
+		 * locks that senders hold while queueing requests.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		numshootdown = curcpu->c_numshootdown;
+		shootdown_all = curcpu->c_shootdown_all;
+		for (i=0; i<numshootdown; i++) {
+			shootdown[i] = curcpu->c_shootdown[i];
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_all = false;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (shootdown_all) {
+		vm_tlbshootdown_all();
+	}
+	else {
+		for (i=0; i<numshootdown; i++) {
+			vm_tlbshootdown(&shootdown[i]);
+		}
+	}
 }
 
 /*
@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -43,12 +45,99 @@
 #include <bitmap.h>
 #include <synch.h>
 #include <wchan.h>
+#include <vnode.h>
+#include <kern/mman.h>
+#include <shm.h>
+#include <slab.h>
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Every address space is on as_list, so the pageout daemon can reclaim
+ * the page table entries of swapped-out pages (as_reclaim_all). An
+ * address space leaves it before it is torn down. Lock order:
+ * as_list_lock, then as_lock.
+ */
+static struct addrspace *as_list;
+static struct lock *as_list_lock;
+
+/*
+ * Page table entries come from a cache of their own, so they take
+ * sizeof(struct pageTableNode) each rather than a kmalloc bucket.
+ */
+static struct kmem_cache *pte_cache;
+
+static void pt_folded_drop(struct addrspace *as, unsigned l1, unsigned jlo,
+	unsigned jhi);
+
+struct pageTableNode *
+pte_alloc(void)
+{
+	return kmem_cache_alloc(pte_cache);
+}
+
+void
+pte_free(struct pageTableNode *pte)
+{
+	kmem_cache_free(pte_cache, pte);
+}
+
+void
+pte_printstats(void)
+{
+	kmem_cache_printstats(pte_cache);
+}
+
+void
+as_bootstrap(void)
+{
+	as_list_lock = lock_create("as_list_lock");
+	if(as_list_lock == NULL){
+		panic("as_bootstrap: cannot create as_list_lock\n");
+	}
+	pte_cache = kmem_cache_create("pte", sizeof(struct pageTableNode),
+		NULL, NULL);
+}
+
+/*
+ * as_list_lock is only held to find the next address space and lock
+ * it, so as_create and as_destroy do not wait for the whole pass. The
+ * place is kept as a position in the list: address spaces created or
+ * destroyed meanwhile only make us visit one twice, or put one off to
+ * the next pass.
+ */
+void
+as_reclaim_all(void)
+{
+	struct addrspace *as;
+	unsigned pos = 0, i;
+
+	while(1){
+		lock_acquire(as_list_lock);
+		as = as_list;
+		for(i = 0; as != NULL && i < pos; i++){
+			as = as->as_next;
+		}
+		//a stale read only puts the reclaim off until next time
+		while(as != NULL && as->as_nswapped == 0){
+			as = as->as_next;
+			pos++;
+		}
+		if(as == NULL){
+			lock_release(as_list_lock);
+			return;
+		}
+		lock_acquire(as->as_lock);
+		lock_release(as_list_lock);
+		vm_pt_reclaim(as);
+		lock_release(as->as_lock);
+		pos++;
+	}
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -63,9 +152,36 @@ as_create(void)
 	 * Initialize as needed.
 	 */
 	as->pageTable = NULL;
-	as->regionInfo = NULL;
+	as->as_cpus = 0;
+	bzero(as->as_asid, sizeof(as->as_asid));
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = regionInfoNodearray_create();
+	if (as->as_regions == NULL) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
+	as->as_lastregion = NULL;
 	as->heap_vbase = 0;
 	as->heap_vbound = 0;
+	as->stack_vbase = USERSTACK;
+	as->as_stacklimit = vm_stacklimit;
+	as->mmap_vbase = AS_MMAPTOP(as);
+	as->as_lastfault = 0;
+	as->as_seqdir = 0;
+	as->as_seqrun = 0;
+	as->as_swapnext = 0;
+	as->as_swapend = 0;
+	as->as_nswapped = 0;
+
+	lock_acquire(as_list_lock);
+	as->as_next = as_list;
+	as_list = as;
+	lock_release(as_list_lock);
 
 	return as;
 }
@@ -82,51 +198,357 @@ as_destroy(struct addrspace *as)
 	if(as == NULL){
 		return;
 	}
-	struct pageTableNode * ptTmp = as->pageTable;
-	struct pageTableNode * ptTmp2 = NULL;
+	struct pageTableNode * ptTmp;
+	struct regionInfoNode * ri;
+	struct addrspace ** pp;
+
+	lock_acquire(as_list_lock);
+	for(pp = &as_list; *pp != as; pp = &(*pp)->as_next){
+		KASSERT(*pp != NULL);
+	}
+	*pp = as->as_next;
+	lock_release(as_list_lock);
+	//as_reclaim_all may have found it just before; wait it out
+	lock_acquire(as->as_lock);
+	lock_release(as->as_lock);
+
+	if(as->pageTable != NULL){
+		for(unsigned i = 0; i < PT_ENTRIES; i++){
+			if(as->pageTable[i] == NULL){
+				continue;
+			}
+			if(PT_ISFOLDED(as->pageTable[i])){
+				pt_folded_drop(as, i, 0, PT_ENTRIES);
+				continue;
+			}
+			for(unsigned j = 0; j < PT_ENTRIES; j++){
+				ptTmp = as->pageTable[i][j];
+				if(ptTmp == NULL){
+					continue;
+				}
+				if(PT_ISRECLAIMED(ptTmp)){
+					spinlock_acquire(&cm_lock);
+					vm_swap_drop(ptTmp);
+					spinlock_release(&cm_lock);
+					continue;
+				}
+				spinlock_acquire(&cm_lock);
+				wait_page_if_busy(ptTmp);
+				user_release_page(ptTmp);
+				spinlock_release(&cm_lock);
+				pte_free(ptTmp);
+			}
+			kfree(as->pageTable[i]);
+		}
+		kfree(as->pageTable);
+	}
+	vm_swap_release(as);
 
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
+	for(unsigned i = 0; i < regionInfoNodearray_num(as->as_regions); i++){
+		ri = regionInfoNodearray_get(as->as_regions, i);
+		if(ri->as_vnode != NULL){
+			VOP_DECREF(ri->as_vnode);
+		}
+		if(ri->as_shm != NULL){
+			shm_detach(ri->as_shm, as, ri->as_fileva);
+		}
+		kfree(ri);
+	}
+	regionInfoNodearray_setsize(as->as_regions, 0);
+	regionInfoNodearray_destroy(as->as_regions);
+
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+
+/*
+ * Swap slot of page J of folded table PF, which must be present.
+ */
+static
+unsigned
+pt_folded_slot(struct pt_folded *pf, unsigned j)
+{
+	struct pt_run *runs = PT_FOLDEDRUNS(pf);
+
+	for(unsigned r = 0; r < pf->pf_nruns; r++){
+		if(j >= runs[r].pr_index && j < runs[r].pr_index + runs[r].pr_count){
+			return runs[r].pr_slot + (j - runs[r].pr_index);
+		}
+	}
+	panic("pt_folded_slot: page %u not in any run\n", j);
+}
+
+static
+bool
+pt_folded_present(struct pt_folded *pf, unsigned j)
+{
+	return (pf->pf_present[j / 32] & ((uint32_t)1 << (j % 32))) != 0;
+}
+
+/*
+ * Free the swap slots of pages [JLO, JHI) of folded table L1, and the
+ * table itself once it has none left.
+ */
+static
+void
+pt_folded_drop(struct addrspace *as, unsigned l1, unsigned jlo, unsigned jhi)
+{
+	struct pt_folded *pf = PT_FOLDEDTABLE(as->pageTable[l1]);
+
+	for(unsigned j = jlo; j < jhi && pf->pf_npresent > 0; j++){
+		if(!pt_folded_present(pf, j)){
+			continue;
+		}
+		pf->pf_present[j / 32] &= ~((uint32_t)1 << (j % 32));
+		pf->pf_npresent--;
 		spinlock_acquire(&cm_lock);
-	}else{
-		cm_lk_hold_before = true;
+		vm_swap_drop(PT_RECLAIMED(pt_folded_slot(pf, j)));
+		spinlock_release(&cm_lock);
 	}
+	if(pf->pf_npresent == 0){
+		as->pageTable[l1] = NULL;
+		kfree(pf);
+	}
+}
 
-	while(ptTmp != NULL){
-		ptTmp2 = ptTmp;
-		ptTmp = ptTmp->next;
+bool
+pt_fold(struct addrspace *as, unsigned l1)
+{
+	struct pageTableNode **l2 = as->pageTable[l1];
+	struct pt_folded *pf;
+	struct pt_run *runs;
+	unsigned j, r, nruns = 0, npresent = 0;
+	size_t size;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(l2 != NULL && !PT_ISFOLDED(l2));
+	for(j = 0; j < PT_ENTRIES; j++){
+		if(l2[j] == NULL){
+			continue;
+		}
+		if(!PT_ISRECLAIMED(l2[j])){
+			return false;
+		}
+		if(npresent == 0 || l2[j - 1] != PT_RECLAIMED(PT_RECLAIMEDSLOT(l2[j]) - 1)){
+			nruns++;
+		}
+		npresent++;
+	}
+	if(npresent == 0){
+		as->pageTable[l1] = NULL;
+		kfree(l2);
+		return true;
+	}
+	//not worth it unless it saves most of the page
+	size = sizeof(struct pt_folded) + nruns * sizeof(struct pt_run);
+	if(size > PT_ENTRIES * sizeof(struct pageTableNode *) / 4){
+		return false;
+	}
+	pf = kmalloc(size);
+	if(pf == NULL){
+		return false;
+	}
+	bzero(pf, sizeof(struct pt_folded));
+	pf->pf_nruns = nruns;
+	pf->pf_npresent = npresent;
+	runs = PT_FOLDEDRUNS(pf);
+	r = 0;
+	for(j = 0; j < PT_ENTRIES; j++){
+		if(l2[j] == NULL){
+			continue;
+		}
+		pf->pf_present[j / 32] |= (uint32_t)1 << (j % 32);
+		if(r > 0 && runs[r - 1].pr_index + runs[r - 1].pr_count == j &&
+		   runs[r - 1].pr_slot + runs[r - 1].pr_count == PT_RECLAIMEDSLOT(l2[j])){
+			runs[r - 1].pr_count++;
+			continue;
+		}
+		KASSERT(r < nruns);
+		runs[r].pr_index = j;
+		runs[r].pr_count = 1;
+		runs[r].pr_slot = PT_RECLAIMEDSLOT(l2[j]);
+		r++;
+	}
+	KASSERT(r == nruns);
+	as->pageTable[l1] = PT_FOLDED(pf);
+	kfree(l2);
+	return true;
+}
 
-		wait_page_if_busy(ptTmp2->pt_pas / PAGE_SIZE);
+int
+pt_unfold(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned l1 = PT_L1_INDEX(vaddr);
+	struct pageTableNode **l2;
+	struct pt_folded *pf;
+	struct pt_run *runs;
+	unsigned j;
 
-		if(ptTmp2->pt_inDisk){
-			// KASSERT(bitmap_isset(vm_bitmap, ptTmp2->pt_bm_index) != 0);
-			bitmap_unmark(vm_bitmap, ptTmp2->pt_bm_index);
-		}else{
-			// KASSERT(ptTmp2->pt_bm_index == 0);
-			user_free_onepage(PADDR_TO_KVADDR(ptTmp2->pt_pas));
+	KASSERT(lock_do_i_hold(as->as_lock));
+	if(as->pageTable == NULL || !PT_ISFOLDED(as->pageTable[l1])){
+		return 0;
+	}
+	pf = PT_FOLDEDTABLE(as->pageTable[l1]);
+	l2 = kmalloc(PT_ENTRIES * sizeof(struct pageTableNode *));
+	if(l2 == NULL){
+		return ENOMEM;
+	}
+	bzero(l2, PT_ENTRIES * sizeof(struct pageTableNode *));
+	runs = PT_FOLDEDRUNS(pf);
+	for(unsigned r = 0; r < pf->pf_nruns; r++){
+		for(unsigned n = 0; n < runs[r].pr_count; n++){
+			j = runs[r].pr_index + n;
+			if(pt_folded_present(pf, j)){
+				l2[j] = PT_RECLAIMED(runs[r].pr_slot + n);
+			}
 		}
-		kfree(ptTmp2);
 	}
+	as->pageTable[l1] = l2;
+	kfree(pf);
+	return 0;
+}
+
+struct pageTableNode *
+pt_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pageTableNode **l2;
 
-	struct regionInfoNode * riTmp = as->regionInfo;
-	struct regionInfoNode * riTmp2 = NULL;
-	while(riTmp != NULL){
-		riTmp2 = riTmp;
-		riTmp = riTmp->next;
-		kfree(riTmp2);
+	if(as->pageTable == NULL){
+		return NULL;
 	}
+	l2 = as->pageTable[PT_L1_INDEX(vaddr)];
+	if(l2 == NULL || PT_ISFOLDED(l2) || PT_ISRECLAIMED(l2[PT_L2_INDEX(vaddr)])){
+		return NULL;
+	}
+	return l2[PT_L2_INDEX(vaddr)];
+}
 
-	kfree(as);
+struct pageTableNode **
+pt_slot(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pageTableNode **l2;
 
-	if(!cm_lk_hold_before){
-		spinlock_release(&cm_lock);
+	if(as->pageTable == NULL){
+		return NULL;
+	}
+	l2 = as->pageTable[PT_L1_INDEX(vaddr)];
+	if(l2 == NULL || PT_ISFOLDED(l2)){
+		return NULL;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+bool
+pt_isreclaimed(struct addrspace *as, vaddr_t vaddr)
+{
+	struct pageTableNode **l2;
+
+	if(as->pageTable == NULL){
+		return false;
+	}
+	l2 = as->pageTable[PT_L1_INDEX(vaddr)];
+	if(l2 == NULL){
+		return false;
+	}
+	if(PT_ISFOLDED(l2)){
+		return pt_folded_present(PT_FOLDEDTABLE(l2), PT_L2_INDEX(vaddr));
+	}
+	return PT_ISRECLAIMED(l2[PT_L2_INDEX(vaddr)]);
+}
+
+int
+pt_insert(struct addrspace *as, struct pageTableNode *pte)
+{
+	unsigned l1 = PT_L1_INDEX(pte->pt_vas);
+	unsigned l2 = PT_L2_INDEX(pte->pt_vas);
+
+	if(as->pageTable == NULL){
+		as->pageTable = kmalloc(PT_ENTRIES * sizeof(struct pageTableNode **));
+		if(as->pageTable == NULL){
+			return ENOMEM;
+		}
+		bzero(as->pageTable, PT_ENTRIES * sizeof(struct pageTableNode **));
+	}
+	if(pt_unfold(as, pte->pt_vas)){
+		return ENOMEM;
+	}
+	if(as->pageTable[l1] == NULL){
+		as->pageTable[l1] = kmalloc(PT_ENTRIES * sizeof(struct pageTableNode *));
+		if(as->pageTable[l1] == NULL){
+			return ENOMEM;
+		}
+		bzero(as->pageTable[l1], PT_ENTRIES * sizeof(struct pageTableNode *));
+	}
+	KASSERT(as->pageTable[l1][l2] == NULL);
+	as->pageTable[l1][l2] = pte;
+	return 0;
+}
+
+void
+pt_remove(struct addrspace *as, vaddr_t vaddr)
+{
+	KASSERT(as->pageTable != NULL);
+	KASSERT(as->pageTable[PT_L1_INDEX(vaddr)] != NULL);
+	KASSERT(!PT_ISFOLDED(as->pageTable[PT_L1_INDEX(vaddr)]));
+	as->pageTable[PT_L1_INDEX(vaddr)][PT_L2_INDEX(vaddr)] = NULL;
+}
+
+void
+pt_release_range(struct addrspace *as, vaddr_t vstart, vaddr_t vend)
+{
+	struct pageTableNode **l2, *cur;
+	vaddr_t va = vstart, lo = vend, hi = vstart, next;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	while(as->pageTable != NULL && va < vend){
+		l2 = as->pageTable[PT_L1_INDEX(va)];
+		if(l2 == NULL){
+			//nothing mapped in this 4 MB window
+			va = (va & ~(vaddr_t)(PT_L1_SPAN - 1)) + PT_L1_SPAN;
+			continue;
+		}
+		if(PT_ISFOLDED(l2)){
+			//all out in swap: just slots, and nothing in the TLB
+			next = (va & ~(vaddr_t)(PT_L1_SPAN - 1)) + PT_L1_SPAN;
+			pt_folded_drop(as, PT_L1_INDEX(va), PT_L2_INDEX(va),
+				next <= vend ? PT_ENTRIES : PT_L2_INDEX(vend));
+			va = next;
+			continue;
+		}
+		cur = l2[PT_L2_INDEX(va)];
+		if(cur != NULL && PT_ISRECLAIMED(cur)){
+			//out in swap: just the slot
+			l2[PT_L2_INDEX(va)] = NULL;
+			spinlock_acquire(&cm_lock);
+			vm_swap_drop(cur);
+			spinlock_release(&cm_lock);
+			va += PAGE_SIZE;
+			continue;
+		}
+		if(cur != NULL){
+			l2[PT_L2_INDEX(va)] = NULL;
+			spinlock_acquire(&cm_lock);
+			wait_page_if_busy(cur);
+			user_release_page(cur);
+			spinlock_release(&cm_lock);
+			pte_free(cur);
+			if(va < lo){
+				lo = va;
+			}
+			hi = va + PAGE_SIZE;
+		}
+		va += PAGE_SIZE;
+	}
+	//nothing runs in this address space until we return, so the
+	//frames cannot be reached through the stale entries meanwhile
+	if(lo < hi){
+		vm_tlb_unmap(as, lo, (hi - lo) / PAGE_SIZE);
 	}
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -134,15 +556,11 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		// kprintf("%d",i);
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	/*
+	 * No flush: entries are tagged with the ASID, so ours stay in
+	 * the TLB while other processes run.
+	 */
+	vm_asid_activate(as);
 }
 
 void
@@ -155,6 +573,50 @@ as_deactivate(void)
 	 */
 }
 
+#define REGION_HAS(ri, va) \
+	((va) >= (ri)->as_vbase && (va) < (ri)->as_vbase + (ri)->as_npages * PAGE_SIZE)
+
+/*
+ * Index of the first region that starts above VADDR; the region
+ * containing VADDR, if any, is the one before it.
+ */
+static
+unsigned
+region_upper(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0, hi = regionInfoNodearray_num(as->as_regions), mid;
+
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(regionInfoNodearray_get(as->as_regions, mid)->as_vbase <= vaddr){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static
+int
+region_insert(struct addrspace *as, struct regionInfoNode *ri)
+{
+	unsigned i, n = regionInfoNodearray_num(as->as_regions);
+	int result;
+
+	i = region_upper(as, ri->as_vbase);
+	result = regionInfoNodearray_setsize(as->as_regions, n + 1);
+	if(result){
+		return result;
+	}
+	for(unsigned j = n; j > i; j--){
+		regionInfoNodearray_set(as->as_regions, j,
+			regionInfoNodearray_get(as->as_regions, j - 1));
+	}
+	regionInfoNodearray_set(as->as_regions, i, ri);
+	return 0;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -189,10 +651,18 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	tmp->as_vbase = vaddr;
 	tmp->as_npages = npages;
 	tmp->as_permission = permission;// code & data = readonly
+	tmp->as_vnode = NULL;
+	tmp->as_offset = 0;
+	tmp->as_fileva = vaddr;
+	tmp->as_filesize = 0;
+	tmp->as_mapflags = 0;
+	tmp->as_shm = NULL;
 	// tmp->as_tmp_permission = permission;
 
-	tmp->next = as->regionInfo;
-	as->regionInfo = tmp;
+	if(region_insert(as, tmp)){
+		kfree(tmp);
+		return ENOMEM;
+	}
 
 	if(as->heap_vbase < tmp->as_vbase + tmp->as_npages * PAGE_SIZE){
 		as->heap_vbase = tmp->as_vbase + tmp->as_npages * PAGE_SIZE;
@@ -201,6 +671,290 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 
 }
 
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+	       off_t offset, size_t filesize)
+{
+	struct regionInfoNode * tmp;
+
+	tmp = as_region_lookup(as, vaddr);
+	if(tmp == NULL || tmp->as_vnode != NULL ||
+	   vaddr + filesize > tmp->as_vbase + tmp->as_npages * PAGE_SIZE){
+		return EINVAL;
+	}
+	if(filesize == 0){
+		//all bss
+		return 0;
+	}
+	VOP_INCREF(v);
+	tmp->as_vnode = v;
+	tmp->as_offset = offset;
+	tmp->as_fileva = vaddr;
+	tmp->as_filesize = filesize;
+	return 0;
+}
+
+struct regionInfoNode *
+as_region_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct regionInfoNode * tmp = as->as_lastregion;
+	unsigned i;
+
+	if(tmp != NULL && REGION_HAS(tmp, vaddr)){
+		return tmp;
+	}
+	i = region_upper(as, vaddr);
+	if(i == 0){
+		return NULL;
+	}
+	tmp = regionInfoNodearray_get(as->as_regions, i - 1);
+	if(!REGION_HAS(tmp, vaddr)){
+		return NULL;
+	}
+	as->as_lastregion = tmp;
+	return tmp;
+}
+
+/*
+ * mmap regions are stacked downward from AS_MMAPTOP; the heap may grow
+ * up to the lowest one (see as_heap_limit).
+ */
+int
+as_define_mmap(struct addrspace *as, size_t npages, int prot, int mapflags,
+	       struct vnode *v, off_t offset, size_t filesize, vaddr_t *ret)
+{
+	vaddr_t heap_end = as->heap_vbase + as->heap_vbound * PAGE_SIZE;
+	struct regionInfoNode * tmp;
+	int result;
+
+	//the heap may already have grown past where mappings start
+	if(heap_end >= as->mmap_vbase ||
+	   npages > (as->mmap_vbase - heap_end) / PAGE_SIZE){
+		return ENOMEM;
+	}
+	tmp = (struct regionInfoNode*)kmalloc(sizeof(struct regionInfoNode));
+	if(tmp == NULL){
+		return ENOMEM;
+	}
+	tmp->as_vbase = as->mmap_vbase - npages * PAGE_SIZE;
+	tmp->as_npages = npages;
+	tmp->as_permission = ((prot & PROT_READ) ? PF_R : 0) |
+		((prot & PROT_WRITE) ? PF_W : 0) |
+		((prot & PROT_EXEC) ? PF_X : 0);
+	tmp->as_vnode = v;
+	tmp->as_offset = offset;
+	tmp->as_fileva = tmp->as_vbase;
+	tmp->as_filesize = filesize;
+	tmp->as_mapflags = mapflags;
+	tmp->as_shm = NULL;
+	if(v != NULL){
+		VOP_INCREF(v);
+	}
+
+	lock_acquire(as->as_lock);
+	result = region_insert(as, tmp);
+	if(result == 0){
+		as->mmap_vbase = tmp->as_vbase;
+	}
+	lock_release(as->as_lock);
+	if(result){
+		if(v != NULL){
+			VOP_DECREF(v);
+		}
+		kfree(tmp);
+		return result;
+	}
+
+	*ret = tmp->as_vbase;
+	return 0;
+}
+
+/*
+ * Give the space back to the heap if the lowest mappings went away.
+ */
+static
+void
+mmap_lower(struct addrspace *as)
+{
+	struct regionInfoNode * ri;
+
+	as->mmap_vbase = AS_MMAPTOP(as);
+	for(unsigned i = 0; i < regionInfoNodearray_num(as->as_regions); i++){
+		ri = regionInfoNodearray_get(as->as_regions, i);
+		if(ri->as_mapflags != 0){
+			as->mmap_vbase = ri->as_vbase;
+			break;
+		}
+	}
+}
+
+/*
+ * The range has to lie inside one mmap region, which is trimmed, split
+ * in two, or removed to match. The pages of a MAP_SHARED region belong
+ * to its segment and stay there for the other mappings.
+ */
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct regionInfoNode * ri, * tail = NULL;
+	struct shm_segment * seg = NULL;
+	vaddr_t vend, rend, segva = 0;
+	unsigned i;
+	int result;
+
+	ri = as_region_lookup(as, vaddr);
+	//segments from shmat are detached whole, with shmdt
+	if(ri == NULL || ri->as_mapflags == 0 ||
+	   (ri->as_shm != NULL && !ri->as_shm->sg_mmap)){
+		return EINVAL;
+	}
+	vend = vaddr + npages * PAGE_SIZE;
+	rend = ri->as_vbase + ri->as_npages * PAGE_SIZE;
+	if(vend <= vaddr || vend > rend){
+		return EINVAL;
+	}
+	if(vaddr > ri->as_vbase && vend < rend){
+		//punching a hole needs a second region for the top part
+		tail = (struct regionInfoNode*)kmalloc(sizeof(struct regionInfoNode));
+		if(tail == NULL){
+			return ENOMEM;
+		}
+		//so that inserting it below cannot fail
+		if(regionInfoNodearray_preallocate(as->as_regions,
+				regionInfoNodearray_num(as->as_regions) + 1)){
+			kfree(tail);
+			return ENOMEM;
+		}
+		//and is one more attachment of a segment
+		if(ri->as_shm != NULL &&
+		   shm_fork(ri->as_shm, as, ri->as_fileva)){
+			kfree(tail);
+			return ENOMEM;
+		}
+	}
+
+	lock_acquire(as->as_lock);
+
+	if(ri->as_shm != NULL){
+		vm_tlb_unmap(as, vaddr, npages);
+	}else{
+		pt_release_range(as, vaddr, vend);
+	}
+
+	if(tail != NULL){
+		*tail = *ri;
+		tail->as_vbase = vend;
+		tail->as_npages = (rend - vend) / PAGE_SIZE;
+		if(tail->as_vnode != NULL){
+			VOP_INCREF(tail->as_vnode);
+		}
+		ri->as_npages = (vaddr - ri->as_vbase) / PAGE_SIZE;
+		result = region_insert(as, tail);
+		KASSERT(result == 0);
+	}else if(vaddr == ri->as_vbase && vend == rend){
+		i = region_upper(as, ri->as_vbase) - 1;
+		KASSERT(regionInfoNodearray_get(as->as_regions, i) == ri);
+		regionInfoNodearray_remove(as->as_regions, i);
+		if(as->as_lastregion == ri){
+			as->as_lastregion = NULL;
+		}
+		if(ri->as_vnode != NULL){
+			VOP_DECREF(ri->as_vnode);
+		}
+		seg = ri->as_shm;
+		segva = ri->as_fileva;
+		kfree(ri);
+	}else if(vaddr == ri->as_vbase){
+		ri->as_vbase = vend;
+		ri->as_npages -= npages;
+	}else{
+		ri->as_npages -= npages;
+	}
+
+	mmap_lower(as);
+
+	lock_release(as->as_lock);
+
+	if(seg != NULL){
+		shm_detach(seg, as, segva);
+	}
+	return 0;
+}
+
+int
+as_define_shm(struct addrspace *as, struct shm_segment *seg, unsigned first,
+	      size_t npages, int prot, vaddr_t *ret)
+{
+	struct regionInfoNode * ri;
+	int result;
+
+	result = as_define_mmap(as, npages, prot,
+				seg->sg_vnode != NULL ? MAP_SHARED : MAP_SHARED | MAP_ANON,
+				NULL, 0, 0, ret);
+	if(result){
+		return result;
+	}
+	lock_acquire(as->as_lock);
+	ri = as_region_lookup(as, *ret);
+	KASSERT(ri != NULL && ri->as_vbase == *ret);
+	ri->as_shm = seg;
+	ri->as_fileva = ri->as_vbase - first * PAGE_SIZE;
+	lock_release(as->as_lock);
+	return 0;
+}
+
+/*
+ * Unlike munmap, a segment is only ever detached whole.
+ */
+int
+as_detach_shm(struct addrspace *as, vaddr_t vaddr, struct shm_segment **ret)
+{
+	struct regionInfoNode * ri;
+	unsigned i;
+
+	lock_acquire(as->as_lock);
+	ri = as_region_lookup(as, vaddr);
+	if(ri == NULL || ri->as_shm == NULL || ri->as_shm->sg_mmap ||
+	   ri->as_vbase != vaddr){
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	i = region_upper(as, ri->as_vbase) - 1;
+	KASSERT(regionInfoNodearray_get(as->as_regions, i) == ri);
+	regionInfoNodearray_remove(as->as_regions, i);
+	if(as->as_lastregion == ri){
+		as->as_lastregion = NULL;
+	}
+	mmap_lower(as);
+	//the frames belong to the segment and stay where they are
+	vm_tlb_unmap(as, ri->as_vbase, ri->as_npages);
+	lock_release(as->as_lock);
+
+	*ret = ri->as_shm;
+	kfree(ri);
+	return 0;
+}
+
+vaddr_t
+as_heap_limit(struct addrspace *as)
+{
+	if(as->mmap_vbase < AS_MMAPTOP(as)){
+		return as->mmap_vbase;
+	}
+	return as->stack_vbase - PAGE_SIZE;
+}
+
+vaddr_t
+as_stack_floor(struct addrspace *as)
+{
+	vaddr_t heap_end = as->heap_vbase + as->heap_vbound * PAGE_SIZE;
+
+	if(heap_end + PAGE_SIZE > AS_MMAPTOP(as)){
+		return heap_end + PAGE_SIZE;
+	}
+	return AS_MMAPTOP(as);
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -247,42 +1001,52 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Resident pages are shared copy-on-write with the parent, and pages
+ * out in swap share the parent's slot; nothing is copied here.
+ */
 static
 int
-PTNode_Copy(struct pageTableNode * new_ptnode, struct pageTableNode * old_ptnode){
-
+PTNode_Copy(struct addrspace * newas, struct pageTableNode * new_ptnode, struct pageTableNode * old_ptnode){
 
-	wait_page_if_busy(old_ptnode->pt_pas / PAGE_SIZE);
+	struct cow_link * link = NULL;
 
-	vaddr_t vaddr_tmp;
 	new_ptnode->pt_vas = old_ptnode->pt_vas;
-	// new_ptnode->pt_isDirty = true;
+	//the child has no swap copy of its own, so it starts dirty unless
+	//the executable has the page
+	new_ptnode->pt_isDirty = !old_ptnode->pt_isFile;
 	new_ptnode->pt_inDisk = false;
+	new_ptnode->pt_hasSlot = false;
 	new_ptnode->pt_bm_index = 0;
-	new_ptnode->next = NULL;
+	new_ptnode->pt_isFile = old_ptnode->pt_isFile;
+	new_ptnode->pt_inFile = false;
+	new_ptnode->pt_ahead = false;
 
-	vaddr_tmp = user_alloc_onepage();
-
-	if(vaddr_tmp == 0){
-		return 1;
+	//the parent is us, so a page out in swap or in the file stays
+	//there; a resident one may still be evicted meanwhile
+	if(!old_ptnode->pt_inDisk && !old_ptnode->pt_inFile){
+		link = cow_link_get();
+		if(link == NULL){
+			return 1;
+		}
 	}
-	new_ptnode->pt_pas = vaddr_tmp - MIPS_KSEG0;
-
-	coremap[new_ptnode->pt_pas / PAGE_SIZE].cm_isbusy = true;
 
-	if(old_ptnode->pt_inDisk){
-		if(block_read((void *)PADDR_TO_KVADDR(new_ptnode->pt_pas), old_ptnode->pt_bm_index * PAGE_SIZE)){
-			panic("block_read error in as_copy\n");
-		}
+	spinlock_acquire(&cm_lock);
+	wait_page_if_busy(old_ptnode);
+	if(old_ptnode->pt_inFile){
+		new_ptnode->pt_pas = 0;
+		new_ptnode->pt_isCow = false;
+		new_ptnode->pt_inFile = true;
+	}else if(old_ptnode->pt_inDisk){
+		vm_swap_share(new_ptnode, old_ptnode);
 	}else{
-		memmove((void *)PADDR_TO_KVADDR(new_ptnode->pt_pas),
-			(const void *)PADDR_TO_KVADDR(old_ptnode->pt_pas),
-			1*PAGE_SIZE);
+		vm_cow_share(newas, new_ptnode, old_ptnode, link);
+		link = NULL;
 	}
-
-	coremap[new_ptnode->pt_pas / PAGE_SIZE].cm_pte = new_ptnode;
-	coremap[new_ptnode->pt_pas / PAGE_SIZE].cm_isbusy = false;
-	wchan_wakeall(cm_wchan, &cm_lock);
+	if(link != NULL){
+		cow_link_put(link);
+	}
+	spinlock_release(&cm_lock);
 
 	return 0;
 }
@@ -302,54 +1066,79 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	 */
 	newas->heap_vbase = old->heap_vbase;
 	newas->heap_vbound = old->heap_vbound;
+	newas->mmap_vbase = old->mmap_vbase;
+	newas->stack_vbase = old->stack_vbase;
+	newas->as_stacklimit = old->as_stacklimit;
 
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
-	}else{
-		cm_lk_hold_before = true;
-	}
+	//newas is on as_list already, so it is built under its lock too
+	lock_acquire(old->as_lock);
+	lock_acquire(newas->as_lock);
 
 	//pageTable
-	struct pageTableNode *oldPTtmp = old->pageTable;
-
-	struct pageTableNode *PTtmp = NULL;
+	struct pageTableNode *oldPTtmp;
 	struct pageTableNode *PTtmp2;
-	while(oldPTtmp != NULL){
-		//PTtmp2 init
-		PTtmp2 = (struct pageTableNode*)kmalloc(sizeof(struct pageTableNode));
-		if(PTtmp2 == NULL){
+	for(unsigned i = 0; old->pageTable != NULL && i < PT_ENTRIES; i++){
+		if(old->pageTable[i] == NULL){
+			continue;
+		}
+		if(pt_unfold(old, i * PT_L1_SPAN)){
+			lock_release(newas->as_lock);
+			lock_release(old->as_lock);
 			as_destroy(newas);
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
-			}
 			return ENOMEM;
 		}
-		if(PTNode_Copy(PTtmp2, oldPTtmp)){
-			kfree(PTtmp2);
-			as_destroy(newas);
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
+		for(unsigned j = 0; j < PT_ENTRIES; j++){
+			oldPTtmp = old->pageTable[i][j];
+			if(oldPTtmp == NULL){
+				continue;
+			}
+			if(PT_ISRECLAIMED(oldPTtmp)){
+				if(vm_pt_expand(old, (i * PT_ENTRIES + j) * PAGE_SIZE)){
+					lock_release(newas->as_lock);
+					lock_release(old->as_lock);
+					as_destroy(newas);
+					return ENOMEM;
+				}
+				oldPTtmp = old->pageTable[i][j];
+			}
+			//PTtmp2 init
+			PTtmp2 = pte_alloc();
+			if(PTtmp2 == NULL){
+				lock_release(newas->as_lock);
+				lock_release(old->as_lock);
+				as_destroy(newas);
+				return ENOMEM;
+			}
+			PTtmp2->pt_vas = oldPTtmp->pt_vas;
+			if(pt_insert(newas, PTtmp2)){
+				pte_free(PTtmp2);
+				lock_release(newas->as_lock);
+				lock_release(old->as_lock);
+				as_destroy(newas);
+				return ENOMEM;
+			}
+			if(PTNode_Copy(newas, PTtmp2, oldPTtmp)){
+				pt_remove(newas, PTtmp2->pt_vas);
+				pte_free(PTtmp2);
+				lock_release(newas->as_lock);
+				lock_release(old->as_lock);
+				as_destroy(newas);
+				return ENOMEM;
 			}
-			return ENOMEM;
 		}
-
-		PTtmp2->next = PTtmp;
-		PTtmp = PTtmp2;
-		oldPTtmp = oldPTtmp->next;
 	}
-	newas->pageTable = PTtmp;
 
-	if(!cm_lk_hold_before){
-		spinlock_release(&cm_lock);
-	}
+	//drop the parent's writable TLB entries for pages now shared
+	vm_asid_retire(old);
 
-	//regionInfo
-	struct regionInfoNode *oldRItmp = old->regionInfo;
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
 
-	struct regionInfoNode *RItmp = NULL;
+	//regions; the old array is already sorted
+	struct regionInfoNode *oldRItmp;
 	struct regionInfoNode *RItmp2;
-	while(oldRItmp != NULL){
+	for(unsigned i = 0; i < regionInfoNodearray_num(old->as_regions); i++){
+		oldRItmp = regionInfoNodearray_get(old->as_regions, i);
 		//RItmp2 init
 		RItmp2 = (struct regionInfoNode*)kmalloc(sizeof(struct regionInfoNode));
 		if(RItmp2 == NULL){
@@ -359,13 +1148,30 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		RItmp2->as_vbase = oldRItmp->as_vbase;
 		RItmp2->as_npages = oldRItmp->as_npages;
 		RItmp2->as_permission = oldRItmp->as_permission;
-		RItmp2->next = NULL;
-		//link
-		RItmp2->next = RItmp;
-		RItmp = RItmp2;
-		oldRItmp = oldRItmp->next;
+		RItmp2->as_vnode = oldRItmp->as_vnode;
+		RItmp2->as_offset = oldRItmp->as_offset;
+		RItmp2->as_fileva = oldRItmp->as_fileva;
+		RItmp2->as_filesize = oldRItmp->as_filesize;
+		RItmp2->as_mapflags = oldRItmp->as_mapflags;
+		RItmp2->as_shm = NULL;
+		if(regionInfoNodearray_add(newas->as_regions, RItmp2, NULL)){
+			kfree(RItmp2);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		if(RItmp2->as_vnode != NULL){
+			VOP_INCREF(RItmp2->as_vnode);
+		}
+		//shared segments and MAP_SHARED mappings stay shared with
+		//the child
+		if(oldRItmp->as_shm != NULL){
+			if(shm_fork(oldRItmp->as_shm, newas, RItmp2->as_fileva)){
+				as_destroy(newas);
+				return ENOMEM;
+			}
+			RItmp2->as_shm = oldRItmp->as_shm;
+		}
 	}
-	newas->regionInfo = RItmp;
 
 	*ret = newas;
 	return 0;
@@ -30,7 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
 #include <vm.h>
+#include <slab.h>
+#include <platform/maxcpus.h>
 #include <kern/test161.h>
 #include <test.h>
 
@@ -123,6 +129,17 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts per-cpu caches of free blocks in front of the
+ * subpage allocator (see the magazine layer below). GUARDS and LABELS
+ * need every block to pass through subpage_kmalloc and subpage_kfree,
+ * so they turn it off.
+ */
+#define MAGAZINES
+#if defined(GUARDS) || defined(LABELS)
+#undef MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -147,7 +164,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref *prev_samesize;
 	struct pageref *next_all;
+	struct pageref *prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -162,10 +181,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the subpage allocator proper. Most allocations
+ * never get this far: the per-cpu magazine layer in front of it
+ * (MAGAZINES) serves them without taking this lock.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -176,8 +194,8 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 170 pagerefs, which can manage up to
+ * 170 * 4K = 680K of kernel heap.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
@@ -187,70 +205,15 @@ struct pagerefpage {
 };
 
 /*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
-
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Free pagerefs are kept on a list, linked through next_all. When it
+ * runs dry we allocate another pageref page, so the pool grows with
+ * the heap rather than having a fixed size. Pageref pages are never
+ * freed.
  */
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
-
-/*
- * Allocate a page to hold pagerefs.
- */
-static
-void
-allocpagerefpage(struct kheap_root *root)
-{
-	vaddr_t va;
-
-	KASSERT(root->page == NULL);
-
-	/*
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-	spinlock_release(&kmalloc_spinlock);
-	va = alloc_kpages(1);
-	spinlock_acquire(&kmalloc_spinlock);
-	if (va == 0) {
-		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
-	}
-	KASSERT(va % PAGE_SIZE == 0);
-
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
-	}
-
-	root->page = (struct pagerefpage *)va;
-}
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;
+static unsigned npagerefs_inuse;
 
 /*
  * Allocate a pageref structure.
@@ -259,44 +222,38 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pagerefpage *page;
+	struct pageref *pr;
+	vaddr_t va;
+	unsigned i;
 
+	if (freepagerefs == NULL) {
 		/*
-		 * This should probably not be a linear search.
+		 * We release the spinlock while calling alloc_kpages. This
+		 * avoids deadlock if alloc_kpages needs to come back here.
+		 * If somebody else adds a page meanwhile we keep both.
 		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+		spinlock_release(&kmalloc_spinlock);
+		va = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (va == 0) {
+			kprintf("kmalloc: Couldn't get a pageref page\n");
+			return NULL;
 		}
+		KASSERT(va % PAGE_SIZE == 0);
+
+		page = (struct pagerefpage *)va;
+		for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+			page->refs[i].next_all = freepagerefs;
+			freepagerefs = &page->refs[i];
+		}
+		npagerefpages++;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_all;
+	npagerefs_inuse++;
+	return pr;
 }
 
 /*
@@ -306,36 +263,31 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+	KASSERT(npagerefs_inuse > 0);
+	p->next_all = freepagerefs;
+	freepagerefs = p;
+	npagerefs_inuse--;
+}
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+/*
+ * The pageref of the heap page VA is on, or NULL if it is not one of
+ * ours: the coremap records it for each page, so kfree need not
+ * search for it.
+ */
+static
+struct pageref *
+page_pageref(vaddr_t va)
+{
+	unsigned index;
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	if (va < MIPS_KSEG0 || va >= MIPS_KSEG1) {
+		return NULL;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	index = (va - MIPS_KSEG0) / PAGE_SIZE;
+	if (index >= cm_num) {
+		return NULL;
+	}
+	return coremap[index].cm_pageref;
 }
 
 ////////////////////////////////////////
@@ -590,14 +542,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < npagerefs_inuse);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < npagerefs_inuse);
 		ac++;
 	}
 
@@ -741,6 +693,12 @@ kheap_dumpall(void)
 
 ////////////////////////////////////////
 
+#ifdef MAGAZINES
+/* in the magazine layer, below */
+static void kmag_printstats(void);
+static unsigned long kmag_cachedbytes(void);
+#endif
+
 /*
  * Print the allocated/freed map of a single kernel heap page.
  */
@@ -807,16 +765,24 @@ kheap_printstats(void)
 {
 	struct pageref *pr;
 
+#ifdef MAGAZINES
+	kmag_printstats();
+#endif
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
+	kprintf("%u pagerefs in use, %u pageref pages\n",
+		npagerefs_inuse, npagerefpages);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr, false);
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printall();
 }
 
 
@@ -829,6 +795,14 @@ kheap_getused(void) {
 	struct pageref *pr;
 	unsigned long total = 0;
 	unsigned int num_pages = 0, coremap_bytes = 0;
+	unsigned long cached = 0;
+
+#ifdef MAGAZINES
+	/* blocks sitting in magazines are not in use */
+	cached = kmag_cachedbytes();
+#endif
+	/* nor are free objects and leftover space in object caches */
+	cached += kmem_cache_idleall();
 
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -844,6 +818,7 @@ kheap_getused(void) {
 	if (coremap_bytes > 0) {
 		total += coremap_bytes - (num_pages * PAGE_SIZE);
 	}
+	total = total > cached ? total - cached : 0;
 
 	spinlock_release(&kmalloc_spinlock);
 
@@ -871,24 +846,28 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	if (pr->prev_all != NULL) {
+		pr->prev_all->next_all = pr->next_all;
+	}
+	else {
+		KASSERT(allbase == pr);
+		allbase = pr->next_all;
+	}
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
 	}
 }
 
@@ -1036,6 +1015,8 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	/* lets kfree find the pageref straight away */
+	coremap[(prpage - MIPS_KSEG0) / PAGE_SIZE].cm_pageref = pr;
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1055,10 +1036,18 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
+	pr->prev_samesize = NULL;
 	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
 	sizebases[blktype] = pr;
 
+	pr->prev_all = NULL;
 	pr->next_all = allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr;
+	}
 	allbase = pr;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
@@ -1113,30 +1102,21 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = page_pageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(prpage == (ptraddr & PAGE_FRAME));
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1190,6 +1170,7 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+		coremap[(prpage - MIPS_KSEG0) / PAGE_SIZE].cm_pageref = NULL;
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1207,6 +1188,317 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+
+#ifdef MAGAZINES
+
+/*
+ * Magazine layer: per-cpu caches of free blocks in front of the
+ * subpage allocator, after Bonwick and Adams, "Magazines and Vmem"
+ * (USENIX 2001).
+ *
+ * For each block size, each cpu has a loaded magazine and the one
+ * loaded before it, each a stack of up to kmag_rounds() free blocks.
+ * kmalloc pops from the loaded magazine and kfree pushes onto it.
+ * When it is empty (or full) and the previous one is not, the two
+ * swap places. Otherwise the cpu trades the previous magazine with the
+ * depot, which keeps full and empty magazines for each block size.
+ * Only when the depot has nothing to trade does a block come from or
+ * go back to the subpage allocator.
+ *
+ * A cpu's magazines are only touched by that cpu, with interrupts
+ * off; the depot has a spinlock of its own. Neither is held while
+ * calling into the subpage allocator.
+ */
+
+#define KMAG_MAXROUNDS 14	/* makes struct kmag 64 bytes */
+
+/* Full magazines the depot keeps per block size; the rest are flushed. */
+#define KDEPOT_MAXFULL 4
+
+struct kmag {
+	struct kmag *m_next;		/* on a depot list */
+	unsigned m_rounds;
+	void *m_round[KMAG_MAXROUNDS];
+};
+
+struct kmag_cpu {
+	struct kmag *kc_loaded[NSIZES];
+	struct kmag *kc_prev[NSIZES];
+	unsigned long kc_allocs;	/* served from a magazine */
+	unsigned long kc_frees;		/* taken into a magazine */
+	unsigned long kc_misses;	/* depot had nothing to trade */
+};
+
+struct kmag_depot {
+	struct kmag *d_full;
+	struct kmag *d_empty;
+	unsigned d_nfull;
+	unsigned d_nempty;
+	unsigned d_nmags;		/* magazines made for this size */
+	unsigned long d_trades;		/* magazines traded with cpus */
+	unsigned long d_flushes;	/* full magazines emptied into pages */
+};
+
+static struct kmag_cpu kmag_cpus[MAXCPUS];
+static struct kmag_depot kmag_depots[NSIZES];
+static struct spinlock kmag_depot_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Blocks per magazine: big blocks get fewer, so that what the caches
+ * hold stays small next to the heap.
+ */
+static
+unsigned
+kmag_rounds(int blktype)
+{
+	unsigned n = PAGE_SIZE / sizes[blktype];
+
+	return n < KMAG_MAXROUNDS ? n : KMAG_MAXROUNDS;
+}
+
+/*
+ * Block type of the heap page PTR is on, or -1 if it is not a page of
+ * the subpage allocator. The caller owns the block, so the page and
+ * its pageref cannot go away underneath us.
+ */
+static
+int
+kmag_blocktype(void *ptr)
+{
+	struct pageref *pr = page_pageref((vaddr_t)ptr);
+
+	return pr == NULL ? -1 : (int)PR_BLOCKTYPE(pr);
+}
+
+/*
+ * Give the blocks of full magazine M back to the subpage allocator and
+ * put it with the depot's empty ones.
+ */
+static
+void
+kmag_flush(int blktype, struct kmag *m)
+{
+	struct kmag_depot *d = &kmag_depots[blktype];
+
+	while (m->m_rounds > 0) {
+		subpage_kfree(m->m_round[--m->m_rounds]);
+	}
+	spinlock_acquire(&kmag_depot_lock);
+	m->m_next = d->d_empty;
+	d->d_empty = m;
+	d->d_nempty++;
+	d->d_flushes++;
+	spinlock_release(&kmag_depot_lock);
+}
+
+/*
+ * Take a block of type BLKTYPE from this cpu's magazines, or return
+ * NULL if they and the depot have none.
+ */
+static
+void *
+kmag_alloc(int blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *d = &kmag_depots[blktype];
+	struct kmag *m, *full;
+	void *ret;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	kc = &kmag_cpus[curcpu->c_number];
+	m = kc->kc_loaded[blktype];
+	if (m == NULL || m->m_rounds == 0) {
+		if (kc->kc_prev[blktype] != NULL &&
+		    kc->kc_prev[blktype]->m_rounds > 0) {
+			kc->kc_loaded[blktype] = kc->kc_prev[blktype];
+			kc->kc_prev[blktype] = m;
+		}
+		else {
+			spinlock_acquire(&kmag_depot_lock);
+			full = d->d_full;
+			if (full != NULL) {
+				d->d_full = full->m_next;
+				d->d_nfull--;
+				/* the previous magazine is empty too */
+				if (kc->kc_prev[blktype] != NULL) {
+					kc->kc_prev[blktype]->m_next = d->d_empty;
+					d->d_empty = kc->kc_prev[blktype];
+					d->d_nempty++;
+				}
+				kc->kc_prev[blktype] = m;
+				kc->kc_loaded[blktype] = full;
+				d->d_trades++;
+			}
+			spinlock_release(&kmag_depot_lock);
+		}
+		m = kc->kc_loaded[blktype];
+		if (m == NULL || m->m_rounds == 0) {
+			kc->kc_misses++;
+			splx(spl);
+			return NULL;
+		}
+	}
+	ret = m->m_round[--m->m_rounds];
+	kc->kc_allocs++;
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put PTR in this cpu's magazines. Returns false if it is not a
+ * subpage block or there was no room for it, in which case it is the
+ * caller's to free. A magazine is only made when we could sleep
+ * anyway, since getting one may need a fresh heap page.
+ */
+static
+bool
+kmag_free(void *ptr)
+{
+	int blktype = kmag_blocktype(ptr);
+	struct kmag_cpu *kc;
+	struct kmag_depot *d;
+	struct kmag *m, *empty, *flush = NULL;
+	unsigned rounds;
+	int spl;
+
+	if (blktype < 0 || !CURCPU_EXISTS()) {
+		return false;
+	}
+	d = &kmag_depots[blktype];
+	rounds = kmag_rounds(blktype);
+
+ again:
+	spl = splhigh();
+	kc = &kmag_cpus[curcpu->c_number];
+	m = kc->kc_loaded[blktype];
+	if (m == NULL || m->m_rounds == rounds) {
+		if (kc->kc_prev[blktype] != NULL &&
+		    kc->kc_prev[blktype]->m_rounds < rounds) {
+			kc->kc_loaded[blktype] = kc->kc_prev[blktype];
+			kc->kc_prev[blktype] = m;
+		}
+		else {
+			spinlock_acquire(&kmag_depot_lock);
+			empty = d->d_empty;
+			if (empty != NULL) {
+				d->d_empty = empty->m_next;
+				d->d_nempty--;
+				/* the previous magazine is full too */
+				if (kc->kc_prev[blktype] != NULL) {
+					if (d->d_nfull >= KDEPOT_MAXFULL) {
+						flush = kc->kc_prev[blktype];
+					}
+					else {
+						kc->kc_prev[blktype]->m_next = d->d_full;
+						d->d_full = kc->kc_prev[blktype];
+						d->d_nfull++;
+					}
+				}
+				kc->kc_prev[blktype] = m;
+				kc->kc_loaded[blktype] = empty;
+				d->d_trades++;
+			}
+			spinlock_release(&kmag_depot_lock);
+		}
+		m = kc->kc_loaded[blktype];
+		if (m == NULL || m->m_rounds == rounds) {
+			kc->kc_misses++;
+			splx(spl);
+			if (curthread->t_in_interrupt || curthread->t_curspl > 0) {
+				/* cannot wait for a fresh heap page */
+				return false;
+			}
+			empty = subpage_kmalloc(sizeof(struct kmag));
+			if (empty == NULL) {
+				return false;
+			}
+			empty->m_rounds = 0;
+			spinlock_acquire(&kmag_depot_lock);
+			empty->m_next = d->d_empty;
+			d->d_empty = empty;
+			d->d_nempty++;
+			d->d_nmags++;
+			spinlock_release(&kmag_depot_lock);
+			goto again;
+		}
+	}
+	m->m_round[m->m_rounds++] = ptr;
+	kc->kc_frees++;
+	splx(spl);
+
+	if (flush != NULL) {
+		kmag_flush(blktype, flush);
+	}
+	return true;
+}
+
+/*
+ * Bytes the magazine layer holds: the free blocks it caches and the
+ * magazines themselves. Per-cpu magazines are read without stopping
+ * their cpus, so this is only a snapshot.
+ */
+static
+unsigned long
+kmag_cachedbytes(void)
+{
+	unsigned long total = 0;
+	struct kmag *m;
+	unsigned i, j;
+
+	spinlock_acquire(&kmag_depot_lock);
+	for (j = 0; j < NSIZES; j++) {
+		for (i = 0; i < MAXCPUS; i++) {
+			m = kmag_cpus[i].kc_loaded[j];
+			if (m != NULL) {
+				total += m->m_rounds * sizes[j];
+			}
+			m = kmag_cpus[i].kc_prev[j];
+			if (m != NULL) {
+				total += m->m_rounds * sizes[j];
+			}
+		}
+		for (m = kmag_depots[j].d_full; m != NULL; m = m->m_next) {
+			total += m->m_rounds * sizes[j];
+		}
+		total += kmag_depots[j].d_nmags *
+			sizes[blocktype(sizeof(struct kmag))];
+	}
+	spinlock_release(&kmag_depot_lock);
+	return total;
+}
+
+static
+void
+kmag_printstats(void)
+{
+	struct kmag_depot *d;
+	unsigned i;
+
+	kprintf("Magazine layer:\n");
+	spinlock_acquire(&kmag_depot_lock);
+	for (i = 0; i < NSIZES; i++) {
+		d = &kmag_depots[i];
+		kprintf("size %-4lu  %2u rounds  %u magazines, depot %u full "
+			"%u empty; %lu trades, %lu flushes\n",
+			(unsigned long)sizes[i], kmag_rounds(i), d->d_nmags,
+			d->d_nfull, d->d_nempty, d->d_trades, d->d_flushes);
+	}
+	spinlock_release(&kmag_depot_lock);
+	for (i = 0; i < num_cpus; i++) {
+		kprintf("cpu%u: %lu allocs, %lu frees from magazines; "
+			"%lu depot misses\n", i, kmag_cpus[i].kc_allocs,
+			kmag_cpus[i].kc_frees, kmag_cpus[i].kc_misses);
+	}
+}
+
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1246,6 +1538,15 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		void *ptr = kmag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1264,7 +1565,13 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	else if (kmag_free(ptr)) {
+		return;
+	}
+#endif
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory segments. See shm.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/shm.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <shm.h>
+
+/*
+ * The segment table. A segment id is its index here; IPC_RMID clears
+ * the slot, and the segment itself goes away at its last detach.
+ * shm_lock is taken before any as_lock. The segments of files mapped
+ * MAP_SHARED are on shm_files instead, one per vnode.
+ */
+static struct shm_segment *shm_table[SHM_MAXSEGS];
+static struct shm_segment *shm_files;
+static struct lock *shm_lock;
+
+void
+shm_bootstrap(void)
+{
+	shm_lock = lock_create("shm_lock");
+	if(shm_lock == NULL){
+		panic("shm_bootstrap: cannot create shm_lock\n");
+	}
+}
+
+static
+void
+shm_destroy(struct shm_segment *seg)
+{
+	struct pageTableNode *pte;
+
+	KASSERT(seg->sg_nattach == 0 && seg->sg_attach == NULL);
+	for(unsigned i = 0; i < seg->sg_npages; i++){
+		pte = seg->sg_pages[i];
+		if(pte == NULL){
+			continue;
+		}
+		spinlock_acquire(&cm_lock);
+		wait_page_if_busy(pte);
+		//pt_pas 0 and not in swap: never touched
+		if(pte->pt_pas != 0 || pte->pt_inDisk){
+			user_release_page(pte);
+		}
+		spinlock_release(&cm_lock);
+		pte_free(pte);
+	}
+	if(seg->sg_vnode != NULL){
+		VOP_DECREF(seg->sg_vnode);
+	}
+	kfree(seg->sg_pages);
+	lock_destroy(seg->sg_lock);
+	kfree(seg);
+}
+
+static
+struct shm_segment *
+shm_create(int key, unsigned npages)
+{
+	struct shm_segment *seg;
+
+	seg = kmalloc(sizeof(*seg));
+	if(seg == NULL){
+		return NULL;
+	}
+	seg->sg_key = key;
+	seg->sg_npages = npages;
+	seg->sg_nattach = 0;
+	seg->sg_removed = false;
+	seg->sg_mmap = false;
+	seg->sg_vnode = NULL;
+	seg->sg_filesize = 0;
+	seg->sg_attach = NULL;
+	seg->sg_next = NULL;
+	seg->sg_lock = lock_create("shm segment");
+	if(seg->sg_lock == NULL){
+		kfree(seg);
+		return NULL;
+	}
+	seg->sg_pages = kmalloc(npages * sizeof(struct pageTableNode *));
+	if(seg->sg_pages == NULL){
+		lock_destroy(seg->sg_lock);
+		kfree(seg);
+		return NULL;
+	}
+	bzero(seg->sg_pages, npages * sizeof(struct pageTableNode *));
+	return seg;
+}
+
+/*
+ * The entry for page INDEX of SEG, made on its first fault from any
+ * process; the page gets its frame then too. Called with sg_lock held.
+ */
+struct pageTableNode *
+shm_page(struct shm_segment *seg, unsigned index)
+{
+	struct pageTableNode *pte;
+
+	KASSERT(lock_do_i_hold(seg->sg_lock));
+	KASSERT(index < seg->sg_npages);
+	if(seg->sg_pages[index] != NULL){
+		return seg->sg_pages[index];
+	}
+	pte = pte_alloc();
+	if(pte == NULL){
+		return NULL;
+	}
+	pte->pt_vas = index * PAGE_SIZE;
+	pte->pt_pas = 0;
+	pte->pt_isDirty = true;
+	pte->pt_inDisk = false;
+	pte->pt_isCow = false;
+	pte->pt_hasSlot = false;
+	pte->pt_bm_index = 0;
+	pte->pt_isFile = false;
+	pte->pt_inFile = false;
+	pte->pt_ahead = false;
+	if(seg->sg_vnode != NULL && pte->pt_vas < seg->sg_filesize){
+		//read in from the file by shm_fill
+		pte->pt_isDirty = false;
+		pte->pt_isFile = true;
+		pte->pt_inFile = true;
+	}
+	seg->sg_pages[index] = pte;
+	return pte;
+}
+
+/*
+ * Make SEG at least NPAGES long, covering FILESIZE bytes of its file.
+ * Called with shm_lock held.
+ */
+static
+int
+shm_grow(struct shm_segment *seg, unsigned npages, off_t filesize)
+{
+	struct pageTableNode **pages;
+
+	KASSERT(lock_do_i_hold(shm_lock));
+	lock_acquire(seg->sg_lock);
+	if(npages > seg->sg_npages){
+		pages = kmalloc(npages * sizeof(struct pageTableNode *));
+		if(pages == NULL){
+			lock_release(seg->sg_lock);
+			return ENOMEM;
+		}
+		bzero(pages, npages * sizeof(struct pageTableNode *));
+		memcpy(pages, seg->sg_pages,
+		       seg->sg_npages * sizeof(struct pageTableNode *));
+		kfree(seg->sg_pages);
+		seg->sg_pages = pages;
+		seg->sg_npages = npages;
+	}
+	if(filesize > seg->sg_filesize){
+		seg->sg_filesize = filesize;
+	}
+	lock_release(seg->sg_lock);
+	return 0;
+}
+
+/*
+ * Write the pages of file segment SEG that changed back to the file,
+ * and take SEG off shm_files. Nobody has it mapped any more; shm_lock
+ * is held throughout, so a new mapping of the file cannot read the
+ * file before this is done.
+ */
+static
+void
+shm_flush(struct shm_segment *seg)
+{
+	struct shm_segment **p;
+	struct regionInfoNode ri;
+	struct pageTableNode *pte;
+
+	KASSERT(lock_do_i_hold(shm_lock));
+	KASSERT(seg->sg_nattach == 0);
+
+	//page i of the segment is page i of the file
+	bzero(&ri, sizeof(ri));
+	ri.as_vnode = seg->sg_vnode;
+	ri.as_offset = 0;
+	ri.as_fileva = 0;
+	ri.as_filesize = seg->sg_filesize;
+	for(unsigned i = 0; i < seg->sg_npages; i++){
+		pte = seg->sg_pages[i];
+		if(pte != NULL && vm_writeback(&ri, pte)){
+			kprintf("shm: lost a page of a shared mapping\n");
+		}
+	}
+
+	for(p = &shm_files; *p != seg; p = &(*p)->sg_next){
+		KASSERT(*p != NULL);
+	}
+	*p = seg->sg_next;
+}
+
+int
+shm_get(int key, size_t size, int flags, int *ret)
+{
+	struct shm_segment *seg;
+	unsigned npages;
+	int i, slot = -1;
+
+	if(size == 0 || size > SHM_MAXPAGES * PAGE_SIZE){
+		return EINVAL;
+	}
+	npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	lock_acquire(shm_lock);
+	for(i = 0; i < SHM_MAXSEGS; i++){
+		seg = shm_table[i];
+		if(seg == NULL){
+			if(slot < 0){
+				slot = i;
+			}
+			continue;
+		}
+		if(key == IPC_PRIVATE || seg->sg_key != key){
+			continue;
+		}
+		lock_release(shm_lock);
+		if((flags & IPC_CREAT) && (flags & IPC_EXCL)){
+			return EEXIST;
+		}
+		if(npages > seg->sg_npages){
+			return EINVAL;
+		}
+		*ret = i;
+		return 0;
+	}
+	if(key != IPC_PRIVATE && !(flags & IPC_CREAT)){
+		lock_release(shm_lock);
+		return ENOENT;
+	}
+	if(slot < 0){
+		lock_release(shm_lock);
+		return ENOSPC;
+	}
+	seg = shm_create(key, npages);
+	if(seg == NULL){
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+	shm_table[slot] = seg;
+	lock_release(shm_lock);
+
+	*ret = slot;
+	return 0;
+}
+
+/*
+ * Add AS at VBASE to SEG's reverse map.
+ */
+static
+void
+shm_link(struct shm_segment *seg, struct shm_attach *sa,
+	 struct addrspace *as, vaddr_t vbase)
+{
+	KASSERT(lock_do_i_hold(shm_lock));
+	sa->sa_as = as;
+	sa->sa_vbase = vbase;
+	spinlock_acquire(&cm_lock);
+	sa->sa_next = seg->sg_attach;
+	seg->sg_attach = sa;
+	spinlock_release(&cm_lock);
+	seg->sg_nattach++;
+}
+
+/*
+ * Take AS at VBASE out of SEG's reverse map and return the entry.
+ */
+static
+struct shm_attach *
+shm_unlink(struct shm_segment *seg, struct addrspace *as, vaddr_t vbase)
+{
+	struct shm_attach **p, *sa;
+
+	KASSERT(lock_do_i_hold(shm_lock));
+	spinlock_acquire(&cm_lock);
+	for(p = &seg->sg_attach; *p != NULL; p = &(*p)->sa_next){
+		if((*p)->sa_as == as && (*p)->sa_vbase == vbase){
+			break;
+		}
+	}
+	sa = *p;
+	KASSERT(sa != NULL);
+	*p = sa->sa_next;
+	spinlock_release(&cm_lock);
+	seg->sg_nattach--;
+	return sa;
+}
+
+int
+shm_attach(int id, struct addrspace *as, int flags, vaddr_t *ret)
+{
+	struct shm_segment *seg;
+	struct shm_attach *sa;
+	int prot, result;
+
+	if(id < 0 || id >= SHM_MAXSEGS){
+		return EINVAL;
+	}
+	prot = (flags & SHM_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+	sa = kmalloc(sizeof(*sa));
+	if(sa == NULL){
+		return ENOMEM;
+	}
+
+	lock_acquire(shm_lock);
+	seg = shm_table[id];
+	if(seg == NULL){
+		lock_release(shm_lock);
+		kfree(sa);
+		return EINVAL;
+	}
+	result = as_define_shm(as, seg, 0, seg->sg_npages, prot, ret);
+	if(result){
+		lock_release(shm_lock);
+		kfree(sa);
+		return result;
+	}
+	//nothing runs in AS until we return, so nobody can have faulted
+	//the new region in before it is in the reverse map
+	shm_link(seg, sa, as, *ret);
+	lock_release(shm_lock);
+	return 0;
+}
+
+/*
+ * Map NPAGES pages of VN's segment from file offset OFFSET on into AS,
+ * making the segment if VN has none yet; FILESIZE bytes of them are in
+ * the file. With no VN the segment is a new anonymous one. Either way
+ * it goes away at its last detach.
+ */
+int
+shm_mmap(struct addrspace *as, size_t npages, int prot, struct vnode *vn,
+	 off_t offset, size_t filesize, vaddr_t *ret)
+{
+	struct shm_segment *seg = NULL;
+	struct shm_attach *sa;
+	unsigned first;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	if(offset / PAGE_SIZE + npages > SHM_MMAPPAGES){
+		return ENOMEM;
+	}
+	first = offset / PAGE_SIZE;
+	sa = kmalloc(sizeof(*sa));
+	if(sa == NULL){
+		return ENOMEM;
+	}
+
+	lock_acquire(shm_lock);
+	if(vn != NULL){
+		for(seg = shm_files; seg != NULL; seg = seg->sg_next){
+			if(seg->sg_vnode == vn){
+				break;
+			}
+		}
+	}
+	if(seg == NULL){
+		seg = shm_create(IPC_PRIVATE, first + npages);
+		if(seg == NULL){
+			lock_release(shm_lock);
+			kfree(sa);
+			return ENOMEM;
+		}
+		seg->sg_removed = true;
+		seg->sg_mmap = true;
+		if(vn != NULL){
+			VOP_INCREF(vn);
+			seg->sg_vnode = vn;
+			seg->sg_next = shm_files;
+			shm_files = seg;
+		}
+	}
+
+	result = shm_grow(seg, first + npages, offset + filesize);
+	if(result == 0){
+		result = as_define_shm(as, seg, first, npages, prot, ret);
+	}
+	if(result){
+		if(seg->sg_nattach == 0){
+			//just made, so there is nothing to write back
+			if(seg->sg_vnode != NULL){
+				shm_flush(seg);
+			}
+			lock_release(shm_lock);
+			shm_destroy(seg);
+		}else{
+			lock_release(shm_lock);
+		}
+		kfree(sa);
+		return result;
+	}
+	shm_link(seg, sa, as, *ret - first * PAGE_SIZE);
+	lock_release(shm_lock);
+	return 0;
+}
+
+/*
+ * AS is a copy of a process that has SEG attached at VBASE.
+ */
+int
+shm_fork(struct shm_segment *seg, struct addrspace *as, vaddr_t vbase)
+{
+	struct shm_attach *sa;
+
+	sa = kmalloc(sizeof(*sa));
+	if(sa == NULL){
+		return ENOMEM;
+	}
+	lock_acquire(shm_lock);
+	KASSERT(seg->sg_nattach > 0);
+	shm_link(seg, sa, as, vbase);
+	lock_release(shm_lock);
+	return 0;
+}
+
+/*
+ * The region at VBASE in AS is gone and its TLB entries dropped.
+ */
+void
+shm_detach(struct shm_segment *seg, struct addrspace *as, vaddr_t vbase)
+{
+	struct shm_attach *sa;
+	bool last;
+
+	lock_acquire(shm_lock);
+	sa = shm_unlink(seg, as, vbase);
+	last = seg->sg_removed && seg->sg_nattach == 0;
+	if(last && seg->sg_vnode != NULL){
+		shm_flush(seg);
+	}
+	lock_release(shm_lock);
+
+	kfree(sa);
+	if(last){
+		shm_destroy(seg);
+	}
+}
+
+int
+shm_remove(int id)
+{
+	struct shm_segment *seg;
+	bool last;
+
+	if(id < 0 || id >= SHM_MAXSEGS){
+		return EINVAL;
+	}
+	lock_acquire(shm_lock);
+	seg = shm_table[id];
+	if(seg == NULL){
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	shm_table[id] = NULL;
+	seg->sg_removed = true;
+	last = seg->sg_nattach == 0;
+	lock_release(shm_lock);
+
+	if(last){
+		shm_destroy(seg);
+	}
+	return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches. See slab.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * A slab is one page: this header, then kc_perslab objects every
+ * kc_stride bytes, the free ones on ks_free. The free list is linked
+ * through a word at kc_link in each object: its first word, or for a
+ * cache with a constructor a word past the end, so a free object stays
+ * constructed. Slabs with free objects are on kc_partial; a slab whose
+ * objects are all free again is released at once, destructing them, so
+ * a cache that drains holds no pages (and no constructed state) at all.
+ * kc_lock protects all of a cache.
+ */
+struct kmem_slab {
+	struct kmem_slab *ks_next;	//on kc_partial
+	struct kmem_slab *ks_prev;
+	void *ks_free;
+	unsigned ks_nfree;
+};
+
+#define KMEM_ALIGN	8
+#define KMEM_ROUNDUP(x)	(((x) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+#define KMEM_HDRSIZE	KMEM_ROUNDUP(sizeof(struct kmem_slab))
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	size_t kc_stride;
+	size_t kc_link;			//offset of the free-list word
+	unsigned kc_perslab;
+	int (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;
+	unsigned kc_npartial;
+	unsigned kc_slabs;		//slabs held
+	unsigned kc_inuse;		//objects allocated
+	unsigned kc_peak;		//most objects allocated at once
+	unsigned long kc_allocs;	//calls to kmem_cache_alloc
+	struct kmem_cache *kc_next;	//on kmem_caches
+};
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+#define KMEM_OBJ(kc, ks, i) \
+	((char *)(ks) + KMEM_HDRSIZE + (i) * (kc)->kc_stride)
+#define KMEM_LINK(kc, obj) (*(void **)((char *)(obj) + (kc)->kc_link))
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+	kc = kmalloc(sizeof(*kc));
+	if(kc == NULL){
+		panic("kmem_cache_create: cannot create %s\n", name);
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	if(ctor != NULL){
+		kc->kc_link = KMEM_ROUNDUP(size);
+		kc->kc_stride = KMEM_ROUNDUP(kc->kc_link + sizeof(void *));
+	}else{
+		kc->kc_link = 0;
+		kc->kc_stride = KMEM_ROUNDUP(size < sizeof(void *) ? sizeof(void *) : size);
+	}
+	if(kc->kc_stride > PAGE_SIZE - KMEM_HDRSIZE){
+		panic("kmem_cache_create: %s objects too large (%u bytes)\n",
+			name, (unsigned)size);
+	}
+	kc->kc_perslab = (PAGE_SIZE - KMEM_HDRSIZE) / kc->kc_stride;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_npartial = 0;
+	kc->kc_slabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_peak = 0;
+	kc->kc_allocs = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+	return kc;
+}
+
+static
+void
+kmem_slab_link(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_partial;
+	if(kc->kc_partial != NULL){
+		kc->kc_partial->ks_prev = ks;
+	}
+	kc->kc_partial = ks;
+	kc->kc_npartial++;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	if(ks->ks_prev != NULL){
+		ks->ks_prev->ks_next = ks->ks_next;
+	}else{
+		kc->kc_partial = ks->ks_next;
+	}
+	if(ks->ks_next != NULL){
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	kc->kc_npartial--;
+}
+
+/*
+ * Destruct the first N objects of a slab and give its page back.
+ */
+static
+void
+kmem_slab_release(struct kmem_cache *kc, struct kmem_slab *ks, unsigned n)
+{
+	if(kc->kc_dtor != NULL){
+		for(unsigned i = 0; i < n; i++){
+			kc->kc_dtor(KMEM_OBJ(kc, ks, i));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Get a page and construct a new slab in it, without kc_lock.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t kva;
+	void *obj;
+
+	kva = alloc_kpages(1);
+	if(kva == 0){
+		return NULL;
+	}
+	ks = (struct kmem_slab *)kva;
+	ks->ks_free = NULL;
+	for(unsigned i = 0; i < kc->kc_perslab; i++){
+		obj = KMEM_OBJ(kc, ks, i);
+		if(kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0){
+			kmem_slab_release(kc, ks, i);
+			return NULL;
+		}
+		KMEM_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+	ks->ks_nfree = kc->kc_perslab;
+	return ks;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+
+	KASSERT(!spinlock_do_i_hold(&cm_lock));
+	spinlock_acquire(&kc->kc_lock);
+	if(kc->kc_partial == NULL){
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if(ks == NULL){
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_link(kc, ks);
+		kc->kc_slabs++;
+	}
+	ks = kc->kc_partial;
+	obj = ks->ks_free;
+	ks->ks_free = KMEM_LINK(kc, obj);
+	if(--ks->ks_nfree == 0){
+		kmem_slab_unlink(kc, ks);
+	}
+	kc->kc_allocs++;
+	if(++kc->kc_inuse > kc->kc_peak){
+		kc->kc_peak = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+
+	KASSERT(obj != NULL);
+	KASSERT(((vaddr_t)obj - (vaddr_t)KMEM_OBJ(kc, ks, 0)) % kc->kc_stride == 0);
+	KASSERT(!spinlock_do_i_hold(&cm_lock));
+	spinlock_acquire(&kc->kc_lock);
+	KMEM_LINK(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	kc->kc_inuse--;
+	if(++ks->ks_nfree == 1){
+		kmem_slab_link(kc, ks);
+	}
+	if(ks->ks_nfree == kc->kc_perslab){
+		kmem_slab_unlink(kc, ks);
+		kc->kc_slabs--;
+		spinlock_release(&kc->kc_lock);
+		kmem_slab_release(kc, ks, kc->kc_perslab);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Bytes of slab pages that hold no allocated object: the free objects
+ * and what is left over in each slab. The pages themselves are counted
+ * as in use by the coremap.
+ */
+static
+unsigned long
+kmem_cache_idlebytes(struct kmem_cache *kc)
+{
+	unsigned long idle;
+
+	spinlock_acquire(&kc->kc_lock);
+	idle = (unsigned long)kc->kc_slabs * PAGE_SIZE -
+		(unsigned long)kc->kc_inuse * kc->kc_stride;
+	spinlock_release(&kc->kc_lock);
+	return idle;
+}
+
+unsigned long
+kmem_cache_idleall(void)
+{
+	struct kmem_cache *kc;
+	unsigned long idle = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	for(; kc != NULL; kc = kc->kc_next){
+		idle += kmem_cache_idlebytes(kc);
+	}
+	return idle;
+}
+
+void
+kmem_cache_printstats(struct kmem_cache *kc)
+{
+	spinlock_acquire(&kc->kc_lock);
+	kprintf("%-12s %5u bytes: %5u in use (peak %u), %lu allocs, %u slabs of %u\n",
+		kc->kc_name, (unsigned)kc->kc_size, kc->kc_inuse, kc->kc_peak,
+		kc->kc_allocs, kc->kc_slabs, kc->kc_perslab);
+	spinlock_release(&kc->kc_lock);
+}
+
+void
+kmem_cache_printall(void)
+{
+	struct kmem_cache *kc;
+
+	/* caches are never destroyed, so the list only grows at its head */
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	for(; kc != NULL; kc = kc->kc_next){
+		kmem_cache_printstats(kc);
+	}
+}
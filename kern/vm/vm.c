@@ -15,14 +15,18 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <uio.h>
+#include <kern/mman.h>
 //bitmap
 #include <bitmap.h>
 #include <kern/stat.h>
 //lock
 #include <synch.h>
 #include <wchan.h>
+#include <thread.h>
 //sec
 #include <clock.h>
+#include <platform/maxcpus.h>
+#include <shm.h>
 
 static struct vnode * swap_vnode;
 static bool booted = false;
@@ -30,6 +34,270 @@ static struct wchan * tlb_wchan;
 
 struct spinlock cm_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Free frames, kept on a list threaded through the coremap (built by
+ * cm_init), and how many there are. Protected by cm_lock.
+ */
+unsigned cm_freehead;
+unsigned cm_nfree;
+
+/*
+ * Replacement policy, clock hand, and per-policy counters so the
+ * policies can be compared with the vmstat menu command.
+ * Protected by cm_lock.
+ */
+static enum vm_policy_t vm_policy = VM_POLICY_CLOCK;
+static const char *vm_policy_names[VM_POLICY_COUNT] = { "sec", "clock" };
+static unsigned cm_hand;
+static struct {
+	unsigned long vs_faults;
+	unsigned long vs_evictions;
+	unsigned long vs_pageouts;
+} vm_stats[VM_POLICY_COUNT];
+
+/*
+ * Pageout daemon: woken when cm_nfree drops below vm_lowater, it
+ * evicts pages until cm_nfree reaches vm_hiwater. Protected by cm_lock.
+ */
+static struct wchan * pageout_wchan;
+
+/*
+ * RLIMIT_STACK, in pages, given to new address spaces (vmstack).
+ */
+unsigned vm_stacklimit = VM_STACKPAGES;
+static unsigned vm_lowater;
+static unsigned vm_hiwater;
+static struct {
+	unsigned long ps_wakeups;
+	unsigned long ps_freed;
+	unsigned long ps_writes;
+	unsigned long ps_syncevictions;
+} pageout_stats;
+
+static void pageout_thread(void *data1, unsigned long data2);
+
+/*
+ * Free frames known to be all zero, on a second list threaded through
+ * the same links (and counted in cm_nfree too), so fresh user pages
+ * need no bzero. Idle cpus refill it to vm_zerotarget from the
+ * ordinary free list (vm_idlezero), so zeroing only ever uses time
+ * no thread wants. Protected by cm_lock.
+ */
+static unsigned cm_zerohead;
+static unsigned cm_nzero;
+static unsigned vm_zerotarget;
+
+/*
+ * A read-only frame of zeros that first-touch reads of anonymous pages
+ * map, shared copy-on-write; a frame of their own comes with the first
+ * write. Its cm_refcount holds one extra reference so it is never
+ * freed. Counters are protected by cm_lock.
+ */
+static unsigned zero_frame;
+static struct {
+	unsigned long zs_maps;		//read faults given the zero frame
+	unsigned long zs_copies;	//...that were later written
+	unsigned long zs_hits;		//fresh pages taken already zeroed
+	unsigned long zs_misses;	//fresh pages zeroed in the fault
+	unsigned long zs_zeroed;	//frames zeroed by idle cpus
+} zero_stats;
+
+/*
+ * Fault-around and sequential prefetch (fault_ahead). Protected by
+ * cm_lock.
+ */
+static struct {
+	unsigned long fa_mapped;	//TLB entries loaded ahead of use
+	unsigned long fa_avoided;	//...for pages then touched without a fault
+	unsigned long fa_missed;	//...that were gone again before their use
+	unsigned long fa_swapins;	//pages swapped in ahead of a run
+	unsigned long fa_zerofills;	//pages zero-filled ahead of a run
+} around_stats;
+
+/*
+ * Threads waiting for a busy frame sleep on one of a few wait channels
+ * picked by frame number, so finishing with one frame does not wake
+ * everyone waiting on any frame.
+ */
+#define CM_NWCHANS 16
+static struct wchan * cm_wchans[CM_NWCHANS];
+
+/*
+ * Swap slots: vm_bitmap marks the slots in use and swap_map records
+ * the page table entry each one belongs to, so swap-in can find the
+ * pages stored next to the one it needs. Slots marked with no entry
+ * are reserved by an address space (see swap_alloc_as), and those of
+ * reclaimed entries (vm_pt_reclaim) hold SWAP_RECLAIMED. A page out in
+ * swap at fork is not read in but shares its slot with the child's
+ * entry: the slot holds SWAP_SHARED, and swap_refs counts the entries
+ * that have it. Only pages out in swap share slots; swap_in settles
+ * the sharing when one comes back. Slot 0 is never used. Protected by
+ * cm_lock.
+ */
+#define SWAP_RECLAIMED ((struct pageTableNode *)1)
+#define SWAP_SHARED ((struct pageTableNode *)2)
+static struct pageTableNode ** swap_map;
+static unsigned * swap_refs;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static unsigned swap_hint;
+static struct {
+	unsigned long ss_clusters;
+	unsigned long ss_clustered;
+	unsigned long ss_readahead;
+	unsigned long ss_runs;		//runs reserved by address spaces
+	unsigned long ss_full;		//evictions given up for lack of swap
+	unsigned long ss_shared;	//pages given a forked copy's slot
+} swapio_stats;
+
+/*
+ * TLB entries dropped for eviction: on this cpu, by request to another
+ * cpu (only those its address space has run on), and whole-TLB flushes
+ * done when a cpu's shootdown queue overflowed. Protected by cm_lock.
+ */
+static struct {
+	unsigned long ts_local;
+	unsigned long ts_remote;
+	unsigned long ts_flushall;
+	unsigned long ts_refills;	//faults on resident pages
+	unsigned long ts_unmapped;	//pages dropped one by one by sbrk/munmap
+} tlb_stats;
+
+/*
+ * Page table entries of swapped-out pages reclaimed and restored
+ * (vm_pt_reclaim, vm_pt_expand). Protected by cm_lock.
+ */
+static struct {
+	unsigned long pr_reclaimed;
+	unsigned long pr_expanded;
+	unsigned long pr_folded;	//second-level tables folded or freed
+	unsigned long pr_passes;	//address spaces scanned
+} ptreclaim_stats;
+static struct timespec tlb_stats_since;
+
+/*
+ * Pages of executables and mapped files read in on first touch, clean
+ * ones dropped by eviction instead of being written to swap, and pages
+ * of shared mappings written back to their file. Protected by cm_lock.
+ */
+static struct {
+	unsigned long fs_pageins;
+	unsigned long fs_drops;
+	unsigned long fs_writebacks;
+} file_stats;
+
+/*
+ * TLB address space IDs, handed out per cpu since each cpu has its own
+ * TLB. ASIDs come from ac_next until they run out; then the TLB is
+ * flushed and a new generation starts, which invalidates every ASID of
+ * the old one (see struct as_asid). ASID 0 is left for entries of no
+ * address space. Each slot is only touched by its own cpu, with
+ * interrupts off.
+ */
+static struct {
+	uint32_t ac_gen;
+	unsigned ac_next;
+	unsigned ac_cur;		//ASID loaded in entryhi
+	unsigned long ac_rollovers;
+} asid_cpu[MAXCPUS];
+
+/*
+ * Take INDEX off whichever free list it is on.
+ */
+static
+void
+cm_freelist_remove(unsigned index)
+{
+	unsigned prev = coremap[index].cm_prev;
+	unsigned next = coremap[index].cm_next;
+	unsigned * head = coremap[index].cm_zeroed ? &cm_zerohead : &cm_freehead;
+
+	if(prev != 0){
+		coremap[prev].cm_next = next;
+	}else{
+		KASSERT(*head == index);
+		*head = next;
+	}
+	if(next != 0){
+		coremap[next].cm_prev = prev;
+	}
+	coremap[index].cm_next = 0;
+	coremap[index].cm_prev = 0;
+	if(coremap[index].cm_zeroed){
+		coremap[index].cm_zeroed = false;
+		cm_nzero--;
+	}
+	cm_nfree--;
+}
+
+static
+void
+cm_list_push(unsigned * head, unsigned index)
+{
+	coremap[index].cm_prev = 0;
+	coremap[index].cm_next = *head;
+	if(*head != 0){
+		coremap[*head].cm_prev = index;
+	}
+	*head = index;
+	cm_nfree++;
+}
+
+static
+void
+cm_freelist_push(unsigned index)
+{
+	coremap[index].cm_zeroed = false;
+	cm_list_push(&cm_freehead, index);
+}
+
+static
+void
+cm_zerolist_push(unsigned index)
+{
+	coremap[index].cm_zeroed = true;
+	cm_list_push(&cm_zerohead, index);
+	cm_nzero++;
+}
+
+/*
+ * Find NPAGES contiguous free frames. Single pages come straight off
+ * the free list; only multi-page kernel allocations need to scan.
+ * Returns the first frame index, or 0 if there is no such run.
+ */
+static
+unsigned
+cm_freelist_take(unsigned npages)
+{
+	unsigned tmp = 0;
+
+	if(npages == 1){
+		//leave the zeroed frames for user pages if we can
+		unsigned index = cm_freehead != 0 ? cm_freehead : cm_zerohead;
+		if(index != 0){
+			cm_freelist_remove(index);
+		}
+		return index;
+	}
+	if(npages > cm_nfree){
+		return 0;
+	}
+	for(unsigned i = cm_addr / PAGE_SIZE ; i < cm_num; i++){
+		if(coremap[i].cm_status == Free){
+			tmp++;
+		}else{
+			tmp = 0;
+		}
+		if(tmp == npages){
+			for(unsigned k = i - npages + 1; k <= i; k++){
+				cm_freelist_remove(k);
+			}
+			return i - npages + 1;
+		}
+	}
+	return 0;
+}
+
 void
 vm_bootstrap(void)
 {
@@ -42,24 +310,85 @@ vm_bootstrap(void)
 		//2 bitmap create
 		struct stat st;
 		VOP_STAT(swap_vnode, &st);
-		vm_bitmap = bitmap_create(st.st_size / PAGE_SIZE);
+		swap_nslots = st.st_size / PAGE_SIZE;
+		vm_bitmap = bitmap_create(swap_nslots);
 		//KASSERT(vm_bitmap != NULL);
+		swap_map = kmalloc(swap_nslots * sizeof(struct pageTableNode *));
+		swap_refs = kmalloc(swap_nslots * sizeof(unsigned));
+		if(vm_bitmap == NULL || swap_map == NULL || swap_refs == NULL){
+			panic("vm_bootstrap: out of memory for swap map\n");
+		}
+		bzero(swap_map, swap_nslots * sizeof(struct pageTableNode *));
+		bzero(swap_refs, swap_nslots * sizeof(unsigned));
+		bitmap_mark(vm_bitmap, 0);
+		swap_nused = 1;
 		swap_lock = lock_create("swap_lock");
 		//KASSERT(swap_lock != NULL);
 	}
 	// spinlock_init(&cm_lock);
 	booted = true;
 	tlb_wchan = wchan_create("tlb_sem");
-	cm_wchan = wchan_create("cm_wchan");
+	gettime(&tlb_stats_since);
+	for(unsigned i = 0; i < CM_NWCHANS; i++){
+		cm_wchans[i] = wchan_create("cm_wchan");
+		if(cm_wchans[i] == NULL){
+			panic("vm_bootstrap: cannot create cm_wchan\n");
+		}
+	}
+	as_bootstrap();
+
+	//3 pageout daemon, default watermarks 1/32 and 1/16 of memory
+	vm_lowater = cm_num / 32 + 1;
+	vm_hiwater = cm_num / 16 + 2;
+	if(vm_swapenabled){
+		pageout_wchan = wchan_create("pageout");
+		if(pageout_wchan == NULL){
+			panic("vm_bootstrap: cannot create pageout wchan\n");
+		}
+		if(thread_fork("pageout", NULL, pageout_thread, NULL, 0)){
+			panic("vm_bootstrap: cannot start pageout thread\n");
+		}
+	}
+
+	//4 the shared zero frame and the pre-zeroed pool
+	vaddr_t zva = alloc_kpages(1);
+	if(zva == 0){
+		panic("vm_bootstrap: cannot allocate the zero frame\n");
+	}
+	bzero((void *)zva, PAGE_SIZE);
+	zero_frame = (zva - MIPS_KSEG0) / PAGE_SIZE;
+	coremap[zero_frame].cm_refcount = 1;
+	vm_zerotarget = cm_num / 16 + 1;
+
+	//5 shared memory segments
+	shm_bootstrap();
 }
 
+/*
+ * Wait until PTE's page is not being moved. A page that went out to
+ * swap (or was dropped) while we slept is done with its frame, so stop
+ * there too.
+ * Called with cm_lock held.
+ */
 void
-wait_page_if_busy(unsigned index) {
-	while(coremap[index].cm_isbusy){
-		wchan_sleep(cm_wchan, &cm_lock);
+wait_page_if_busy(struct pageTableNode * pte) {
+	unsigned index;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	while(!pte->pt_inDisk && !pte->pt_inFile){
+		index = pte->pt_pas / PAGE_SIZE;
+		if(!coremap[index].cm_isbusy){
+			break;
+		}
+		wchan_sleep(cm_wchans[index % CM_NWCHANS], &cm_lock);
 	}
 }
 
+void
+wakeup_page(unsigned index) {
+	wchan_wakeall(cm_wchans[index % CM_NWCHANS], &cm_lock);
+}
+
 int
 block_write(void *buffer, off_t offset/*default size: PAGE_SIZE*/){
 	struct iovec iov;
@@ -94,398 +423,2131 @@ block_read(void * buffer, off_t offset){
 	return 0;
 }
 
-
-
+/*
+ * Move NPAGES pages between the frames at KVADDRS and consecutive swap
+ * slots starting at SLOT as a single request, so the disk sees one
+ * sequential transfer instead of one per page. Called with cm_lock
+ * held; like block_write/block_read it is dropped for the I/O.
+ */
 static
-paddr_t
-swap_out(enum cm_status_t status, unsigned npages){
+int
+block_io_cluster(vaddr_t * kvaddrs, unsigned npages, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	int result;
 
-	//try swap out:(check vm_swapenabled at very first)
-	if(npages > 1){
-		panic("npages > 1");
-	}
-	if(!vm_swapenabled){
-		return 0;
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	for(unsigned i = 0; i < npages; i++){
+		iov[i].iov_kbase = (void *)kvaddrs[i];
+		iov[i].iov_len = PAGE_SIZE;
 	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
 
-	paddr_t pa;
-
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
+	spinlock_release(&cm_lock);
+	if(rw == UIO_WRITE){
+		result = VOP_WRITE(swap_vnode, &u);
 	}else{
-		cm_lk_hold_before = true;
+		result = VOP_READ(swap_vnode, &u);
 	}
-	//1. select a coremap index to evict as a victim
-	unsigned victim = 0;
+	spinlock_acquire(&cm_lock);
+	return result;
+}
 
-	struct timespec ts;
-    gettime(&ts);
-	time_t tmp_sec;
-	tmp_sec = ts.tv_sec;
-	for(unsigned i = cm_addr / PAGE_SIZE ; i < cm_num; i++){
-		if(coremap[i].cm_status != Fixed && !coremap[i].cm_isbusy){
-			if(coremap[i].cm_sec == 0){
-				victim = i;
-				break;
-			}else if(coremap[i].cm_sec <= tmp_sec){
-				tmp_sec  = coremap[i].cm_sec;
-				victim = i;
+/*
+ * Allocate NPAGES consecutive swap slots, searching from where the
+ * last allocation ended.
+ */
+static
+int
+swap_alloc(unsigned npages, unsigned * ret)
+{
+	unsigned run = 0;
+
+	for(unsigned n = 0; n < swap_nslots; n++){
+		unsigned i = (swap_hint + n) % swap_nslots;
+		if(i == 0 || bitmap_isset(vm_bitmap, i)){
+			//runs do not wrap around the end of the disk
+			run = 0;
+			if(bitmap_isset(vm_bitmap, i)){
+				continue;
 			}
 		}
-
+		run++;
+		if(run == npages){
+			*ret = i + 1 - npages;
+			for(unsigned k = *ret; k <= i; k++){
+				bitmap_mark(vm_bitmap, k);
+			}
+			swap_nused += npages;
+			swap_hint = (i + 1) % swap_nslots;
+			return 0;
+		}
 	}
-	// while(1){
-	// 	victim = random() % cm_num;
-	// 	if(coremap[victim].cm_status != Fixed && !coremap[victim].cm_isbusy){
-	// 		coremap[victim].cm_status = Fixed;
-	// 		break;
-	// 	}
-	// }
+	return ENOSPC;
+}
 
-	if(victim == 0){
-		if(!cm_lk_hold_before){
-			spinlock_release(&cm_lock);
+static
+void
+swap_assign(unsigned index, struct pageTableNode * pte)
+{
+	KASSERT(bitmap_isset(vm_bitmap, index));
+	swap_map[index] = pte;
+	pte->pt_bm_index = index;
+	pte->pt_hasSlot = true;
+}
+
+static
+void
+swap_free(struct pageTableNode * pte)
+{
+	unsigned slot = pte->pt_bm_index;
+
+	KASSERT(pte->pt_hasSlot);
+	pte->pt_hasSlot = false;
+	if(swap_map[slot] == SWAP_SHARED){
+		KASSERT(swap_refs[slot] > 0);
+		if(--swap_refs[slot] > 0){
+			return;
 		}
-		return 0;
+	}else{
+		KASSERT(swap_map[slot] == pte);
 	}
-	coremap[victim].cm_status = Fixed;
-	pa = victim * PAGE_SIZE;
-	unsigned k = victim;
-	//2. check its status and block_write(may not need)
-	//2.1 find pid and related ptnode
-	coremap[k].cm_isbusy = true;
-	pid_t tmp_pid = coremap[k].cm_pid;
-	struct pageTableNode * tmp_ptNode = coremap[k].cm_pte;
-	KASSERT(tmp_ptNode != NULL);
+	bitmap_unmark(vm_bitmap, slot);
+	swap_map[slot] = NULL;
+	swap_nused--;
+}
 
-	//2.2 check isDirty and swap_out
+/*
+ * PTE, an entry of a forked copy, gets the page FROM has out in swap
+ * by sharing its slot. A shared slot is never reclaimed (vm_pt_reclaim)
+ * so it does not count in as_nswapped. Called with cm_lock held.
+ */
+void
+vm_swap_share(struct pageTableNode * pte, struct pageTableNode * from)
+{
+	unsigned slot = from->pt_bm_index;
 
-	unsigned index;
-	if(bitmap_alloc(vm_bitmap, &index)){
-		panic("bitmap_alloc(vm_bitmap, &index)");
-	}
-	//KASSERT(bitmap_isset(vm_bitmap, index) != 0);
-	//block_write
-	if(block_write((void *)PADDR_TO_KVADDR(k * PAGE_SIZE), index * PAGE_SIZE)){
-		panic("block_write((void *)PADDR_TO_KVADDR(k * PAGE_SIZE), index * PAGE_SIZE");
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(from->pt_inDisk && from->pt_hasSlot);
+	if(swap_map[slot] == from){
+		swap_map[slot] = SWAP_SHARED;
+		swap_refs[slot] = 1;
 	}
-	tmp_ptNode->pt_bm_index = index;
+	KASSERT(swap_map[slot] == SWAP_SHARED);
+	swap_refs[slot]++;
+	pte->pt_pas = 0;
+	pte->pt_isDirty = false;
+	pte->pt_inDisk = true;
+	pte->pt_isCow = false;
+	pte->pt_hasSlot = true;
+	pte->pt_bm_index = slot;
+	swapio_stats.ss_shared++;
+}
 
+/*
+ * Give back the unused rest of AS's reserved run.
+ */
+static
+void
+swap_unreserve(struct addrspace * as)
+{
+	for(unsigned i = as->as_swapnext; i < as->as_swapend; i++){
+		KASSERT(swap_map[i] == NULL);
+		bitmap_unmark(vm_bitmap, i);
+		swap_nused--;
+	}
+	as->as_swapnext = as->as_swapend = 0;
+}
 
-	//3. modify its status
-	tmp_ptNode->pt_inDisk = true;
-	// tmp_ptNode->pt_isDirty = true;
-	tmp_ptNode->pt_pas = 0;
+/*
+ * Allocate NPAGES consecutive swap slots for pages of AS. Each address
+ * space takes its slots in order from a run of SWAP_RUN it reserves at
+ * a time, so its pages sit next to each other on disk however evictions
+ * from different processes interleave, and swap_in's read-ahead finds
+ * them. Returns ENOSPC if swap is full.
+ */
+static
+int
+swap_alloc_as(struct addrspace * as, unsigned npages, unsigned * ret)
+{
+	unsigned run, slot;
+
+	if(as->as_swapend - as->as_swapnext < npages){
+		run = npages > SWAP_RUN ? npages : SWAP_RUN;
+		if(swap_alloc(run, &slot)){
+			//nearly full: settle for what was asked
+			run = npages;
+			if(swap_alloc(run, &slot)){
+				return ENOSPC;
+			}
+		}
+		swap_unreserve(as);
+		as->as_swapnext = slot;
+		as->as_swapend = slot + run;
+		swapio_stats.ss_runs++;
+	}
+	*ret = as->as_swapnext;
+	as->as_swapnext += npages;
+	return 0;
+}
 
+/*
+ * Whether a swap slot can be had for the page in frame K, if it needs
+ * one to be evicted.
+ */
+static
+bool
+swap_has_room(unsigned k)
+{
+	struct pageTableNode * pte = coremap[k].cm_pte;
+	struct addrspace * as = coremap[k].cm_as;
 
-	if(k == victim){
-		coremap[k].cm_len = npages;
-	}else{
-		coremap[k].cm_len = 0;
+	if(pte->pt_hasSlot || (!pte->pt_isDirty && pte->pt_isFile)){
+		return true;
 	}
-	coremap[k].cm_status = status;
-	if(status == Dirty){
-		coremap[k].cm_pid = curproc->p_PID;
-	}else{
-		coremap[k].cm_pid = -1;
+	if(as == NULL){
+		//page of a shared segment: takes any free slot
+		return swap_nused < swap_nslots;
 	}
-	coremap[k].cm_pte = NULL;
-	coremap[k].cm_isbusy = false;
-	coremap[k].cm_intlb = false;
-	coremap[k].cm_sec = 0;
+	return swap_nused < swap_nslots || as->as_swapnext < as->as_swapend;
+}
+
+void
+vm_swap_release(struct addrspace * as)
+{
+	if(!vm_swapenabled){
+		return;
+	}
+	spinlock_acquire(&cm_lock);
+	swap_unreserve(as);
+	spinlock_release(&cm_lock);
+}
 
-	wchan_wakeall(cm_wchan, &cm_lock);
+void
+vm_swap_drop(struct pageTableNode * entry)
+{
+	unsigned slot = PT_RECLAIMEDSLOT(entry);
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(PT_ISRECLAIMED(entry));
+	KASSERT(swap_map[slot] == SWAP_RECLAIMED);
+	bitmap_unmark(vm_bitmap, slot);
+	swap_map[slot] = NULL;
+	swap_nused--;
+}
 
-	//tlbshootdown
-	int spl;
-	uint32_t ehi, elo;
-	ehi = tmp_ptNode->pt_vas;
-
-	if(coremap[k].cm_intlb){
-		if(curcpu == procTable[tmp_pid]->p_thread->t_cpu){
-			// kprintf("S\n");
-			spl = splhigh();
-			elo = k * PAGE_SIZE;
-			int i = tlb_probe(ehi, elo);
-			if(i >= 0){
-				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+/*
+ * Free the entries of AS's pages that are out in swap, leaving just
+ * their swap slots in the page table, so a process that is mostly
+ * swapped out does not hold kernel heap for every page it has. Only
+ * plain anonymous pages qualify: one out in swap needs nothing but its
+ * slot to be brought back. A second-level table left with only such
+ * slots is folded, and one left empty freed (pt_fold). Returns the
+ * number of entries freed.
+ */
+unsigned
+vm_pt_reclaim(struct addrspace * as)
+{
+	struct pageTableNode ** l2, * pte;
+	unsigned n = 0, folded = 0;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	spinlock_acquire(&cm_lock);
+	as->as_nswapped = 0;
+	ptreclaim_stats.pr_passes++;
+	spinlock_release(&cm_lock);
+
+	for(unsigned i = 0; as->pageTable != NULL && i < PT_ENTRIES; i++){
+		l2 = as->pageTable[i];
+		if(l2 == NULL || PT_ISFOLDED(l2)){
+			continue;
+		}
+		for(unsigned j = 0; j < PT_ENTRIES; j++){
+			pte = l2[j];
+			//eviction only ever sets pt_inDisk, so a page we skip
+			//here just waits for the next pass
+			if(pte == NULL || PT_ISRECLAIMED(pte) || !pte->pt_inDisk){
+				continue;
 			}
-			coremap[k].cm_intlb = false;
-			splx(spl);
-		}else{
-			// kprintf("tlbshootdown\n");
-			struct tlbshootdown ts; //= (struct tlbshootdown *)kmalloc(sizeof(struct tlbshootdown));
-			ts.ts_placeholder = k * PAGE_SIZE;
-			ts.ts_cmindex = k;
-			ipi_tlbshootdown(procTable[tmp_pid]->p_thread->t_cpu, &ts);
-			while (coremap[k].cm_intlb) {
-				wchan_sleep(tlb_wchan, &cm_lock);
+			spinlock_acquire(&cm_lock);
+			if(!pte->pt_inDisk || !pte->pt_hasSlot || pte->pt_isFile ||
+			   swap_map[pte->pt_bm_index] != pte){
+				spinlock_release(&cm_lock);
+				continue;
 			}
+			swap_map[pte->pt_bm_index] = SWAP_RECLAIMED;
+			l2[j] = PT_RECLAIMED(pte->pt_bm_index);
+			ptreclaim_stats.pr_reclaimed++;
+			spinlock_release(&cm_lock);
+			pte_free(pte);
+			n++;
+		}
+		if(pt_fold(as, i)){
+			folded++;
 		}
 	}
+	spinlock_acquire(&cm_lock);
+	ptreclaim_stats.pr_folded += folded;
+	spinlock_release(&cm_lock);
+	return n;
+}
 
-	if(!cm_lk_hold_before){
+/*
+ * Give the reclaimed page at VADDR its entry back, and the pages after
+ * it in the same table whose slots follow its slot, so swap_in's
+ * read-ahead finds them. Returns 0 if VADDR has no reclaimed entry, or
+ * ENOMEM if it cannot have one.
+ */
+int
+vm_pt_expand(struct addrspace * as, vaddr_t vaddr)
+{
+	struct pageTableNode ** slotp;
+	struct pageTableNode * pte;
+	unsigned slot, n;
+
+	if(!pt_isreclaimed(as, vaddr)){
+		return 0;
+	}
+	if(pt_unfold(as, vaddr)){
+		return ENOMEM;
+	}
+	slotp = pt_slot(as, vaddr);
+	slot = PT_RECLAIMEDSLOT(*slotp);
+	for(n = 0; n < SWAP_CLUSTER; n++){
+		if(n > 0){
+			vaddr += PAGE_SIZE;
+			if(PT_L2_INDEX(vaddr) == 0){
+				break;
+			}
+			slotp++;
+			if(*slotp != PT_RECLAIMED(slot + n)){
+				break;
+			}
+		}
+		pte = pte_alloc();
+		if(pte == NULL){
+			return n == 0 ? ENOMEM : 0;
+		}
+		pte->pt_vas = vaddr;
+		pte->pt_pas = 0;
+		pte->pt_isDirty = false;
+		pte->pt_inDisk = true;
+		pte->pt_isCow = false;
+		pte->pt_hasSlot = true;
+		pte->pt_bm_index = slot + n;
+		pte->pt_isFile = false;
+		pte->pt_inFile = false;
+		pte->pt_ahead = false;
+		spinlock_acquire(&cm_lock);
+		KASSERT(swap_map[slot + n] == SWAP_RECLAIMED);
+		swap_map[slot + n] = pte;
+		*slotp = pte;
+		ptreclaim_stats.pr_expanded++;
 		spinlock_release(&cm_lock);
 	}
+	return 0;
+}
 
-	return pa;
+void
+vm_printswapstats(void)
+{
+	unsigned nfree = 0, nreserved = 0, extents = 0, run = 0, largest = 0;
 
+	if(!vm_swapenabled){
+		kprintf("swap: disabled\n");
+		return;
+	}
+	spinlock_acquire(&cm_lock);
+	for(unsigned i = 1; i < swap_nslots; i++){
+		if(bitmap_isset(vm_bitmap, i)){
+			if(swap_map[i] == NULL){
+				nreserved++;
+			}
+			run = 0;
+			continue;
+		}
+		nfree++;
+		if(run++ == 0){
+			extents++;
+		}
+		if(run > largest){
+			largest = run;
+		}
+	}
+	kprintf("swap: %u of %u slots used (%u KB), %u free, %u reserved but unused\n",
+		swap_nused - 1, swap_nslots - 1, (swap_nused - 1) * (PAGE_SIZE / 1024),
+		nfree, nreserved);
+	kprintf("free space: %u extents, largest %u slots; %u%% fragmented\n",
+		extents, largest, nfree == 0 ? 0 : 100 - largest * 100 / nfree);
+	kprintf("runs reserved: %lu; evictions given up for lack of swap: %lu\n",
+		swapio_stats.ss_runs, swapio_stats.ss_full);
+	kprintf("pages sharing a slot with a forked copy: %lu\n",
+		swapio_stats.ss_shared);
+	spinlock_release(&cm_lock);
 }
 
 
-vaddr_t
-alloc_kpages(unsigned npages)
+
+static
+void
+tlb_flush_local(void)
 {
-	paddr_t pa = 0;
-    unsigned tmp = 0;
+	int i, spl;
 
-	//spinlock_acquire
-	//1. &cm_lock:
-	bool cm_lk_hold_before = false;
-	if(booted){
-		if(!spinlock_do_i_hold(&cm_lock)){
-			spinlock_acquire(&cm_lock);
-		}else{
-			cm_lk_hold_before = true;
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(asid_cpu[curcpu->c_number].ac_cur);
+	splx(spl);
+}
+
+void
+vm_asid_activate(struct addrspace *as)
+{
+	unsigned n = curcpu->c_number;
+	int spl;
+
+	KASSERT(n < MAXCPUS && n < 32);
+	spl = splhigh();
+	if(asid_cpu[n].ac_gen == 0){
+		asid_cpu[n].ac_gen = 1;
+		asid_cpu[n].ac_next = 1;
+	}
+	if(as->as_asid[n].aa_gen != asid_cpu[n].ac_gen){
+		if(asid_cpu[n].ac_next == NUM_ASID){
+			tlb_flush_local();
+			asid_cpu[n].ac_gen++;
+			asid_cpu[n].ac_next = 1;
+			asid_cpu[n].ac_rollovers++;
 		}
+		as->as_asid[n].aa_asid = asid_cpu[n].ac_next++;
+		as->as_asid[n].aa_gen = asid_cpu[n].ac_gen;
 	}
+	/* from now on this cpu's TLB may hold our pages */
+	as->as_cpus |= (uint32_t)1 << n;
+	asid_cpu[n].ac_cur = as->as_asid[n].aa_asid;
+	tlb_setasid(asid_cpu[n].ac_cur);
+	splx(spl);
+}
 
-    for(unsigned i = cm_addr / PAGE_SIZE ; i < cm_num; i++){
-        if(coremap[i].cm_status == Free){
-            tmp++;
-        }else{
-            tmp = 0;
-        }
-        if(tmp == npages){
-            pa = (i - npages + 1) * PAGE_SIZE;
-            for(unsigned k = i - npages + 1; k <= i;k++){
-                coremap[k].cm_status = Fixed;
-				coremap[k].cm_isbusy = false;
-				coremap[k].cm_pid = -1;
-				coremap[k].cm_len = 0;
-				coremap[k].cm_intlb = false;
-				coremap[i].cm_sec = 0;
-                if(k == i - npages + 1){
-                    coremap[k].cm_len = npages;
-                }
-            }
-			if(booted){
-				if(!cm_lk_hold_before){
-					spinlock_release(&cm_lock);
-				}
-			}
-            return PADDR_TO_KVADDR(pa);
-        }
-    }
-	//all bootstrap steps must not take up all of memory,
-	//so don't worry about "booted" variable not used in swap_out().
-	pa = swap_out(Fixed, npages);
-	if(pa == 0){
-		if(booted){
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
+/*
+ * Make every TLB entry of AS unreachable by giving it fresh ASIDs,
+ * instead of hunting the entries down on each cpu. Called by the
+ * thread running in AS, which is then the only cpu using it.
+ */
+void
+vm_asid_retire(struct addrspace *as)
+{
+	for(unsigned n = 0; n < MAXCPUS; n++){
+		as->as_asid[n].aa_gen = 0;
+	}
+	as->as_cpus = 0;
+	vm_asid_activate(as);
+}
+
+/*
+ * Drop this CPU's TLB entry for VADDR in AS, if it maps frame PADDR.
+ */
+static
+void
+tlb_invalidate_local(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	unsigned n = curcpu->c_number;
+	uint32_t ehi, elo;
+	int spl, i;
+
+	spl = splhigh();
+	if(as->as_asid[n].aa_gen != asid_cpu[n].ac_gen){
+		//its entries here went with the last rollover
+		splx(spl);
+		return;
+	}
+	i = tlb_probe(vaddr | (as->as_asid[n].aa_asid << TLBHI_PIDSHIFT), 0);
+	if(i >= 0){
+		tlb_read(&ehi, &elo, i);
+		if((elo & TLBLO_PPAGE) == paddr){
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	tlb_setasid(asid_cpu[n].ac_cur);
+	splx(spl);
+}
+
+/*
+ * Load a TLB entry mapping VADDR of the current address space to
+ * PADDR, replacing the one it has if any.
+ */
+static
+void
+tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	uint32_t ehi, elo;
+	int spl, i;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ehi = vaddr | (asid_cpu[curcpu->c_number].ac_cur << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_VALID;
+	if(writable){
+		elo |= TLBLO_DIRTY;
+	}
+	i = tlb_probe(ehi, 0);
+	if(i >= 0){
+		tlb_write(ehi, elo, i);
+	}else{
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
+
+/*
+ * The cpus whose TLB may map frame K, and dropping its entries from
+ * this cpu's TLB. A page of a shared segment may be mapped by every
+ * attachment, each at its own address (the reverse map in shm.h).
+ * Called with cm_lock held.
+ */
+static
+uint32_t
+frame_tlb_cpus(unsigned k)
+{
+	struct shm_attach * sa;
+	uint32_t mask = 0;
+
+	if(coremap[k].cm_shm == NULL){
+		KASSERT(coremap[k].cm_as != NULL);
+		return coremap[k].cm_as->as_cpus;
+	}
+	for(sa = coremap[k].cm_shm->sg_attach; sa != NULL; sa = sa->sa_next){
+		mask |= sa->sa_as->as_cpus;
+	}
+	return mask;
+}
+
+static
+void
+frame_tlb_invalidate_local(unsigned k)
+{
+	struct pageTableNode * pte = coremap[k].cm_pte;
+	struct shm_attach * sa;
+
+	if(coremap[k].cm_shm == NULL){
+		tlb_invalidate_local(coremap[k].cm_as, pte->pt_vas, k * PAGE_SIZE);
+		return;
+	}
+	for(sa = coremap[k].cm_shm->sg_attach; sa != NULL; sa = sa->sa_next){
+		tlb_invalidate_local(sa->sa_as, sa->sa_vbase + pte->pt_vas, k * PAGE_SIZE);
+	}
+}
+
+/*
+ * Drop the TLB entries for NPAGES pages from VADDR up, which were just
+ * unmapped from AS, the current address space. Here they are probed
+ * for one at a time, so the rest of our entries stay; if there are more
+ * of them than the TLB holds, a fresh ASID is cheaper. No other cpu has
+ * AS active, so its entries elsewhere are dropped by forgetting its
+ * ASIDs there instead of sending shootdowns.
+ */
+void
+vm_tlb_unmap(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	unsigned n = curcpu->c_number;
+	int spl, i;
+
+	KASSERT(as == proc_getas());
+	if(npages > NUM_TLB){
+		vm_asid_retire(as);
+		return;
+	}
+
+	spl = splhigh();
+	for(unsigned c = 0; c < MAXCPUS; c++){
+		if(c != n){
+			as->as_asid[c].aa_gen = 0;
+		}
+	}
+	as->as_cpus &= (uint32_t)1 << n;
+	if(as->as_asid[n].aa_gen == asid_cpu[n].ac_gen){
+		for(unsigned p = 0; p < npages; p++){
+			i = tlb_probe((vaddr + p * PAGE_SIZE) |
+				      (as->as_asid[n].aa_asid << TLBHI_PIDSHIFT), 0);
+			if(i >= 0){
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+		tlb_setasid(asid_cpu[n].ac_cur);
+	}
+	splx(spl);
+
+	spinlock_acquire(&cm_lock);
+	tlb_stats.ts_unmapped += npages;
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * A frame can be evicted if it holds a user page with exactly one
+ * mapping and nobody is already moving it. A frame shared
+ * copy-on-write becomes evictable once all but one of its mappings
+ * are gone (cow_unlink).
+ */
+static
+bool
+cm_evictable(unsigned i)
+{
+	return coremap[i].cm_status != Fixed && coremap[i].cm_status != Free
+		&& !coremap[i].cm_isbusy
+		&& coremap[i].cm_refcount == 1 && coremap[i].cm_pte != NULL
+		&& swap_has_room(i);
+}
+
+static
+unsigned
+choose_victim_sec(void)
+{
+	unsigned victim = 0;
+
+	struct timespec ts;
+    gettime(&ts);
+	time_t tmp_sec;
+	tmp_sec = ts.tv_sec;
+	for(unsigned i = cm_addr / PAGE_SIZE ; i < cm_num; i++){
+		if(cm_evictable(i)){
+			if(coremap[i].cm_sec == 0){
+				victim = i;
+				break;
+			}else if(coremap[i].cm_sec <= tmp_sec){
+				tmp_sec  = coremap[i].cm_sec;
+				victim = i;
+			}
+		}
+
+	}
+	return victim;
+}
+
+/*
+ * Second chance: sweep from where the hand stopped last time, clearing
+ * cm_ref as we go. vm_fault sets cm_ref when it maps a page, so to see
+ * later references we also drop the page from this CPU's TLB, which
+ * makes the next access refault. Pages of processes running elsewhere
+ * keep their TLB entries and just get the one pass of grace.
+ */
+static
+unsigned
+choose_victim_clock(void)
+{
+	unsigned first = cm_addr / PAGE_SIZE;
+	uint32_t self = (uint32_t)1 << curcpu->c_number;
+
+	if(cm_hand < first || cm_hand >= cm_num){
+		cm_hand = first;
+	}
+	//two full turns: the first may only be clearing reference bits
+	for(unsigned n = 0; n < 2 * (cm_num - first); n++){
+		unsigned k = cm_hand;
+		cm_hand = (cm_hand + 1 < cm_num) ? cm_hand + 1 : first;
+
+		if(!cm_evictable(k)){
+			continue;
+		}
+		if(!coremap[k].cm_ref){
+			return k;
+		}
+		coremap[k].cm_ref = false;
+		//make the next use fault so it sets cm_ref again; other cpus
+		//may still have it, in which case eviction shoots it down
+		if(coremap[k].cm_intlb){
+			frame_tlb_invalidate_local(k);
+			if((frame_tlb_cpus(k) & ~self) == 0){
+				coremap[k].cm_intlb = false;
+			}
+		}
+	}
+	return 0;
+}
+
+static
+unsigned
+choose_victim(void)
+{
+	switch(vm_policy){
+	    case VM_POLICY_CLOCK:
+		return choose_victim_clock();
+	    case VM_POLICY_SEC:
+	    default:
+		return choose_victim_sec();
+	}
+}
+
+int
+vm_setpolicy(const char *name)
+{
+	for(unsigned i = 0; i < VM_POLICY_COUNT; i++){
+		if(!strcmp(name, vm_policy_names[i])){
+			spinlock_acquire(&cm_lock);
+			vm_policy = i;
+			spinlock_release(&cm_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+vm_resetstats(void)
+{
+	spinlock_acquire(&cm_lock);
+	bzero(vm_stats, sizeof(vm_stats));
+	bzero(&pageout_stats, sizeof(pageout_stats));
+	bzero(&swapio_stats, sizeof(swapio_stats));
+	bzero(&tlb_stats, sizeof(tlb_stats));
+	bzero(&file_stats, sizeof(file_stats));
+	bzero(&zero_stats, sizeof(zero_stats));
+	bzero(&around_stats, sizeof(around_stats));
+	bzero(&ptreclaim_stats, sizeof(ptreclaim_stats));
+	gettime(&tlb_stats_since);
+	spinlock_release(&cm_lock);
+}
+
+void
+vm_printstats(void)
+{
+	struct timespec now;
+	unsigned long rollovers = 0;
+
+	spinlock_acquire(&cm_lock);
+	kprintf("policy: %s\n", vm_policy_names[vm_policy]);
+	kprintf("%-8s %12s %12s %12s\n", "", "faults", "evictions", "swapwrites");
+	for(unsigned i = 0; i < VM_POLICY_COUNT; i++){
+		kprintf("%-8s %12lu %12lu %12lu\n", vm_policy_names[i],
+			vm_stats[i].vs_faults, vm_stats[i].vs_evictions,
+			vm_stats[i].vs_pageouts);
+	}
+	kprintf("free frames: %u of %u (low %u, high %u)\n",
+		cm_nfree, cm_num, vm_lowater, vm_hiwater);
+	kprintf("pageout: %lu wakeups, %lu freed, %lu written; %lu synchronous evictions\n",
+		pageout_stats.ps_wakeups, pageout_stats.ps_freed,
+		pageout_stats.ps_writes, pageout_stats.ps_syncevictions);
+	kprintf("swap i/o: %lu clustered writes (%lu pages), %lu pages read ahead\n",
+		swapio_stats.ss_clusters, swapio_stats.ss_clustered,
+		swapio_stats.ss_readahead);
+	kprintf("file pages: %lu read on fault, %lu dropped clean, %lu written back\n",
+		file_stats.fs_pageins, file_stats.fs_drops, file_stats.fs_writebacks);
+	kprintf("zero page: %lu reads mapped, %lu copied on write\n",
+		zero_stats.zs_maps, zero_stats.zs_copies);
+	kprintf("zeroed pool: %u of %u; %lu hits, %lu misses, %lu zeroed when idle\n",
+		cm_nzero, vm_zerotarget, zero_stats.zs_hits, zero_stats.zs_misses,
+		zero_stats.zs_zeroed);
+	kprintf("fault-around: %lu entries loaded ahead, %lu faults avoided, %lu lost before use\n",
+		around_stats.fa_mapped, around_stats.fa_avoided, around_stats.fa_missed);
+	kprintf("prefetch: %lu pages swapped in ahead, %lu zero-filled ahead\n",
+		around_stats.fa_swapins, around_stats.fa_zerofills);
+	kprintf("tlb shootdowns: %lu local, %lu remote, %lu full flushes; %lu pages unmapped\n",
+		tlb_stats.ts_local, tlb_stats.ts_remote, tlb_stats.ts_flushall,
+		tlb_stats.ts_unmapped);
+	gettime(&now);
+	timespec_sub(&now, &tlb_stats_since, &now);
+	for(unsigned i = 0; i < MAXCPUS; i++){
+		rollovers += asid_cpu[i].ac_rollovers;
+	}
+	kprintf("tlb refills: %lu in %lu.%02lu s (%lu/s); %lu asid rollovers\n",
+		tlb_stats.ts_refills, (unsigned long)now.tv_sec,
+		(unsigned long)now.tv_nsec / 10000000,
+		now.tv_sec > 0 ? tlb_stats.ts_refills / (unsigned long)now.tv_sec : tlb_stats.ts_refills,
+		rollovers);
+	kprintf("page table reclaim: %lu entries of swapped-out pages freed, %lu restored, %lu tables folded, %lu passes\n",
+		ptreclaim_stats.pr_reclaimed, ptreclaim_stats.pr_expanded,
+		ptreclaim_stats.pr_folded, ptreclaim_stats.pr_passes);
+	spinlock_release(&cm_lock);
+	pte_printstats();
+	proc_printstats();
+}
+
+/*
+ * Evicting the page in busy frame K goes in three steps. First take
+ * it out of the owner's TLB, so it cannot be written behind our back.
+ * Then write it to swap, but only if it is dirty or has never been
+ * written: a clean page keeps its old slot and costs no I/O at all.
+ * Finally point the page table entry at the swap copy.
+ */
+static
+void
+evict_unmap_start(unsigned k)
+{
+	KASSERT(coremap[k].cm_isbusy);
+	struct pageTableNode * tmp_ptNode = coremap[k].cm_pte;
+	KASSERT(tmp_ptNode != NULL);
+	uint32_t self = (uint32_t)1 << curcpu->c_number;
+	uint32_t mask;
+
+	if(!coremap[k].cm_intlb){
+		return;
+	}
+	//only cpus that have run an owner can have it in their TLB
+	mask = frame_tlb_cpus(k);
+	if(mask & self){
+		frame_tlb_invalidate_local(k);
+		tlb_stats.ts_local++;
+	}
+	mask &= ~self;
+	coremap[k].cm_tlbcpus = mask;
+	if(mask != 0){
+		struct tlbshootdown ts;
+		for(uint32_t m = mask; m != 0; m &= m - 1){
+			tlb_stats.ts_remote++;
+		}
+		ts.ts_vaddr = tmp_ptNode->pt_vas;
+		ts.ts_cmindex = k;
+		ipi_tlbshootdown_mask(mask, &ts);
+	}
+}
+
+static
+void
+evict_unmap_wait(unsigned k)
+{
+	while(coremap[k].cm_tlbcpus != 0){
+		wchan_sleep(tlb_wchan, &cm_lock);
+	}
+	coremap[k].cm_intlb = false;
+}
+
+static
+void
+evict_unmap(unsigned k)
+{
+	evict_unmap_start(k);
+	evict_unmap_wait(k);
+}
+
+static
+bool
+evict_needs_write(unsigned k)
+{
+	struct pageTableNode * pte = coremap[k].cm_pte;
+
+	//clean pages of the executable are just dropped
+	return pte->pt_isDirty || (!pte->pt_hasSlot && !pte->pt_isFile);
+}
+
+static
+void
+evict_write(unsigned k)
+{
+	struct pageTableNode * tmp_ptNode = coremap[k].cm_pte;
+
+	if(!evict_needs_write(k)){
+		return;
+	}
+	KASSERT(tmp_ptNode->pt_hasSlot);
+	if(block_write((void *)PADDR_TO_KVADDR(k * PAGE_SIZE), tmp_ptNode->pt_bm_index * PAGE_SIZE)){
+		panic("block_write((void *)PADDR_TO_KVADDR(k * PAGE_SIZE), index * PAGE_SIZE");
+	}
+	vm_stats[vm_policy].vs_pageouts++;
+}
+
+/*
+ * Give the page in busy frame K a swap slot if evicting it will need
+ * one. Done as soon as the victim is chosen, so running out of swap
+ * means the page is simply not evicted rather than found out after it
+ * has been unmapped. cm_evictable has already checked there is room.
+ */
+static
+int
+evict_reserve(unsigned k)
+{
+	struct pageTableNode * pte = coremap[k].cm_pte;
+	unsigned index;
+
+	if(!evict_needs_write(k) || pte->pt_hasSlot){
+		return 0;
+	}
+	if(coremap[k].cm_as != NULL ? swap_alloc_as(coremap[k].cm_as, 1, &index) :
+	   swap_alloc(1, &index)){
+		swapio_stats.ss_full++;
+		return ENOSPC;
+	}
+	swap_assign(index, pte);
+	return 0;
+}
+
+static
+void
+evict_commit(unsigned k)
+{
+	struct pageTableNode * tmp_ptNode = coremap[k].cm_pte;
+
+	if(tmp_ptNode->pt_hasSlot){
+		tmp_ptNode->pt_inDisk = true;
+		if(coremap[k].cm_as != NULL){
+			coremap[k].cm_as->as_nswapped++;
+		}
+	}else{
+		KASSERT(tmp_ptNode->pt_isFile && !tmp_ptNode->pt_isDirty);
+		tmp_ptNode->pt_inFile = true;
+		file_stats.fs_drops++;
+	}
+	tmp_ptNode->pt_isDirty = false;
+	tmp_ptNode->pt_pas = 0;
+}
+
+static
+void
+evict_page(unsigned k)
+{
+	evict_unmap(k);
+	evict_write(k);
+	evict_commit(k);
+}
+
+/*
+ * Evict the N busy frames in FRAMES together. The pages that need
+ * writing are sorted by owner and virtual address, and each owner's
+ * pages are moved to consecutive slots of its swap run when there is
+ * room, so neighbours in a process stay neighbours on disk (which is
+ * what swap_in's read-ahead looks for). Every stretch of consecutive
+ * slots goes out in a single request. Returns the number of pages
+ * written.
+ */
+static
+unsigned
+evict_cluster(unsigned * frames, unsigned n)
+{
+	unsigned dirty[SWAP_CLUSTER];
+	vaddr_t kvaddrs[SWAP_CLUSTER];
+	unsigned ndirty = 0, slot, i, j;
+	struct pageTableNode * pte;
+	struct addrspace * as;
+
+	KASSERT(n <= SWAP_CLUSTER);
+	//queue every shootdown before waiting, so each cpu takes one
+	//interrupt for the whole cluster
+	for(i = 0; i < n; i++){
+		evict_unmap_start(frames[i]);
+	}
+	for(i = 0; i < n; i++){
+		evict_unmap_wait(frames[i]);
+	}
+	for(i = 0; i < n; i++){
+		if(!evict_needs_write(frames[i])){
+			continue;
+		}
+		//insertion sort by (owner, vaddr)
+		as = coremap[frames[i]].cm_as;
+		pte = coremap[frames[i]].cm_pte;
+		for(j = ndirty; j > 0; j--){
+			struct pageTableNode * prev = coremap[dirty[j-1]].cm_pte;
+			if(coremap[dirty[j-1]].cm_as < as ||
+			   (coremap[dirty[j-1]].cm_as == as &&
+			    prev->pt_vas < pte->pt_vas)){
+				break;
+			}
+			dirty[j] = dirty[j-1];
+		}
+		dirty[j] = frames[i];
+		ndirty++;
+	}
+
+	//renumber each owner's pages into its run; if that fails the
+	//slots from evict_reserve are kept
+	for(i = 0; i < ndirty; i = j){
+		as = coremap[dirty[i]].cm_as;
+		for(j = i + 1; j < ndirty && coremap[dirty[j]].cm_as == as; j++);
+		if(as != NULL && j - i > 1 && swap_alloc_as(as, j - i, &slot) == 0){
+			for(unsigned m = i; m < j; m++){
+				pte = coremap[dirty[m]].cm_pte;
+				if(pte->pt_hasSlot){
+					swap_free(pte);
+				}
+				swap_assign(slot + m - i, pte);
+			}
+		}
+	}
+
+	for(i = 0; i < ndirty; i = j){
+		slot = coremap[dirty[i]].cm_pte->pt_bm_index;
+		kvaddrs[0] = PADDR_TO_KVADDR(dirty[i] * PAGE_SIZE);
+		for(j = i + 1; j < ndirty &&
+		    coremap[dirty[j]].cm_pte->pt_bm_index == slot + j - i; j++){
+			kvaddrs[j - i] = PADDR_TO_KVADDR(dirty[j] * PAGE_SIZE);
+		}
+		if(j - i == 1){
+			evict_write(dirty[i]);
+			continue;
+		}
+		if(block_io_cluster(kvaddrs, j - i, slot, UIO_WRITE)){
+			panic("evict_cluster: swap write error\n");
+		}
+		vm_stats[vm_policy].vs_pageouts += j - i;
+		swapio_stats.ss_clusters++;
+		swapio_stats.ss_clustered += j - i;
+	}
+
+	for(i = 0; i < n; i++){
+		evict_commit(frames[i]);
+	}
+	return ndirty;
+}
+
+static
+paddr_t
+swap_out(enum cm_status_t status, unsigned npages){
+
+	//try swap out:(check vm_swapenabled at very first)
+	if(npages > 1){
+		panic("npages > 1");
+	}
+	if(!vm_swapenabled){
+		return 0;
+	}
+
+	paddr_t pa;
+
+	bool cm_lk_hold_before = false;
+	if(!spinlock_do_i_hold(&cm_lock)){
+		spinlock_acquire(&cm_lock);
+	}else{
+		cm_lk_hold_before = true;
+	}
+	//1. select a coremap index to evict as a victim
+	unsigned victim = choose_victim();
+
+	if(victim == 0 || evict_reserve(victim)){
+		if(swap_nused >= swap_nslots){
+			swapio_stats.ss_full++;
+		}
+		if(!cm_lk_hold_before){
+			spinlock_release(&cm_lock);
+		}
+		return 0;
+	}
+	vm_stats[vm_policy].vs_evictions++;
+	pageout_stats.ps_syncevictions++;
+	coremap[victim].cm_status = Fixed;
+	pa = victim * PAGE_SIZE;
+	unsigned k = victim;
+
+	//2. evict the page it holds
+	coremap[k].cm_isbusy = true;
+	evict_page(k);
+
+	//3. hand the frame to the caller
+	if(k == victim){
+		coremap[k].cm_len = npages;
+	}else{
+		coremap[k].cm_len = 0;
+	}
+	coremap[k].cm_status = status;
+	if(status == Dirty){
+		coremap[k].cm_pid = curproc->p_PID;
+		coremap[k].cm_refcount = 1;
+	}else{
+		coremap[k].cm_pid = -1;
+		coremap[k].cm_refcount = 0;
+	}
+	coremap[k].cm_pte = NULL;
+	coremap[k].cm_as = NULL;
+	coremap[k].cm_shm = NULL;
+	coremap[k].cm_isbusy = false;
+	coremap[k].cm_intlb = false;
+	coremap[k].cm_sec = 0;
+	coremap[k].cm_ref = false;
+
+	wakeup_page(k);
+
+	if(!cm_lk_hold_before){
+		spinlock_release(&cm_lock);
+	}
+
+	return pa;
+
+}
+
+
+/*
+ * Called with cm_lock held after taking frames off the free list.
+ */
+static
+void
+pageout_check(void)
+{
+	if(pageout_wchan != NULL && cm_nfree < vm_lowater){
+		wchan_wakeone(pageout_wchan, &cm_lock);
+	}
+}
+
+/*
+ * Evict up to SWAP_CLUSTER pages as one cluster and put their frames
+ * on the free list. Returns false if nothing could be evicted.
+ */
+static
+bool
+pageout_batch(void)
+{
+	unsigned frames[SWAP_CLUSTER];
+	unsigned n = 0, k;
+
+	while(n < SWAP_CLUSTER && cm_nfree + n < vm_hiwater){
+		k = choose_victim();
+		if(k == 0 || evict_reserve(k)){
+			break;
+		}
+		vm_stats[vm_policy].vs_evictions++;
+		coremap[k].cm_status = Fixed;
+		coremap[k].cm_isbusy = true;
+		frames[n++] = k;
+	}
+	if(n == 0){
+		return false;
+	}
+
+	pageout_stats.ps_writes += evict_cluster(frames, n);
+
+	for(unsigned i = 0; i < n; i++){
+		k = frames[i];
+		coremap[k].cm_status = Free;
+		coremap[k].cm_pid = -1;
+		coremap[k].cm_len = 0;
+		coremap[k].cm_refcount = 0;
+		coremap[k].cm_pte = NULL;
+		coremap[k].cm_as = NULL;
+		coremap[k].cm_shm = NULL;
+		coremap[k].cm_isbusy = false;
+		coremap[k].cm_intlb = false;
+		coremap[k].cm_sec = 0;
+		coremap[k].cm_ref = false;
+		cm_freelist_push(k);
+		wakeup_page(k);
+	}
+	pageout_stats.ps_freed += n;
+	return true;
+}
+
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&cm_lock);
+	while(1){
+		wchan_sleep(pageout_wchan, &cm_lock);
+		pageout_stats.ps_wakeups++;
+		while(cm_nfree < vm_hiwater && pageout_batch()){
+			/* keep going */
+		}
+		//the entries of what went out need not stay in the kernel heap
+		spinlock_release(&cm_lock);
+		as_reclaim_all();
+		spinlock_acquire(&cm_lock);
+	}
+}
+
+/*
+ * Zero one free frame into the zeroed pool. Called by thread_switch on
+ * a cpu with nothing to run, with interrupts off and no run queue lock
+ * held; returns false, so the cpu goes idle, once the pool is full or
+ * memory is short. The check is made unlocked first so idle cpus do
+ * not fight over cm_lock for nothing.
+ */
+bool
+vm_idlezero(void)
+{
+	unsigned k;
+
+	if(vm_zerotarget == 0 || cm_nzero >= vm_zerotarget){
+		return false;
+	}
+	spinlock_acquire(&cm_lock);
+	if(cm_nzero >= vm_zerotarget || cm_freehead == 0 ||
+	   cm_nfree <= vm_lowater){
+		spinlock_release(&cm_lock);
+		return false;
+	}
+	k = cm_freehead;
+	cm_freelist_remove(k);
+	//off both lists, and not Free, while we work on it
+	coremap[k].cm_status = Fixed;
+	spinlock_release(&cm_lock);
+	bzero((void *)PADDR_TO_KVADDR(k * PAGE_SIZE), PAGE_SIZE);
+	spinlock_acquire(&cm_lock);
+	coremap[k].cm_status = Free;
+	cm_zerolist_push(k);
+	zero_stats.zs_zeroed++;
+	spinlock_release(&cm_lock);
+	return true;
+}
+
+int
+vm_setstacklimit(unsigned npages)
+{
+	//leave at least half the address space for everything else
+	if(npages < 2 || npages > USERSTACK / PAGE_SIZE / 2){
+		return EINVAL;
+	}
+	vm_stacklimit = npages;
+	return 0;
+}
+
+int
+vm_setwatermarks(unsigned low, unsigned high)
+{
+	if(low == 0 || high < low || high >= cm_num){
+		return EINVAL;
+	}
+	spinlock_acquire(&cm_lock);
+	vm_lowater = low;
+	vm_hiwater = high;
+	pageout_check();
+	spinlock_release(&cm_lock);
+	return 0;
+}
+
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa = 0;
+    unsigned first;
+
+	//spinlock_acquire
+	//1. &cm_lock:
+	bool cm_lk_hold_before = false;
+	if(booted){
+		if(!spinlock_do_i_hold(&cm_lock)){
+			spinlock_acquire(&cm_lock);
+		}else{
+			cm_lk_hold_before = true;
+		}
+	}
+
+	first = cm_freelist_take(npages);
+	if(first != 0){
+		pa = first * PAGE_SIZE;
+		for(unsigned k = first; k < first + npages; k++){
+			coremap[k].cm_status = Fixed;
+			coremap[k].cm_isbusy = false;
+			coremap[k].cm_pid = -1;
+			coremap[k].cm_len = 0;
+			coremap[k].cm_refcount = 0;
+			coremap[k].cm_intlb = false;
+			coremap[k].cm_sec = 0;
+			coremap[k].cm_ref = false;
+			if(k == first){
+				coremap[k].cm_len = npages;
+			}
+		}
+		if(booted){
+			pageout_check();
+			if(!cm_lk_hold_before){
+				spinlock_release(&cm_lock);
+			}
+		}
+		return PADDR_TO_KVADDR(pa);
+	}
+	//all bootstrap steps must not take up all of memory,
+	//so don't worry about "booted" variable not used in swap_out().
+	pa = swap_out(Fixed, npages);
+	if(pa == 0){
+		if(booted){
+			if(!cm_lk_hold_before){
+				spinlock_release(&cm_lock);
+			}
+		}
+		return 0;
+	}
+
+	if(booted){
+		if(!cm_lk_hold_before){
+			spinlock_release(&cm_lock);
+		}
+	}
+	return PADDR_TO_KVADDR(pa);// no
+}
+
+
+/*
+ * Set up a frame just taken off the free list as a page of curproc.
+ */
+static
+void
+user_frame_init(unsigned i)
+{
+	coremap[i].cm_status = Dirty;
+	coremap[i].cm_len = 1;
+	coremap[i].cm_refcount = 1;
+	coremap[i].cm_pid = curproc->p_PID;
+	coremap[i].cm_isbusy = false;
+	coremap[i].cm_intlb = false;
+	coremap[i].cm_sec = 0;
+	coremap[i].cm_ref = false;
+}
+
+/*
+ * Take a frame for a page of curproc, evicting one if none is free.
+ * If ZEROED is not NULL a frame from the zeroed pool is preferred, and
+ * *ZEROED tells whether we got one. The frame has no cm_pte yet, so
+ * nothing else will touch it until the caller installs one. Called
+ * with cm_lock held; returns 0 if no frame could be found.
+ */
+static
+unsigned
+user_take_frame(bool * zeroed)
+{
+	unsigned i = 0;
+
+	if(zeroed != NULL){
+		i = cm_zerohead;
+		*zeroed = i != 0;
+		if(i != 0){
+			cm_freelist_remove(i);
+		}
+	}
+	if(i == 0){
+		i = cm_freelist_take(1);
+	}
+	if(i != 0){
+		user_frame_init(i);
+		pageout_check();
+		return i;
+	}
+	return swap_out(Dirty, 1) / PAGE_SIZE;
+}
+
+vaddr_t
+user_alloc_onepage()
+{
+	unsigned i;
+	bool zeroed = false;
+
+	KASSERT(!spinlock_do_i_hold(&cm_lock));
+	spinlock_acquire(&cm_lock);
+	i = user_take_frame(&zeroed);
+	if(i != 0){
+		if(zeroed){
+			zero_stats.zs_hits++;
+		}else{
+			zero_stats.zs_misses++;
+		}
+	}
+	spinlock_release(&cm_lock);
+	if(i == 0){
+		return 0;
+	}
+	if(!zeroed){
+		bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), PAGE_SIZE);
+	}
+	return PADDR_TO_KVADDR(i * PAGE_SIZE);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	// (void)addr;
+    paddr_t paddr1 = addr - MIPS_KSEG0;
+    if(paddr1 > ram_getsize()){
+        return;
+    }
+    int index = paddr1 / PAGE_SIZE;
+
+    // synchronization
+	//spinlock_acquire
+	//1. &cm_lock:
+	bool cm_lk_hold_before = false;
+	if(booted){
+		if(!spinlock_do_i_hold(&cm_lock)){
+			spinlock_acquire(&cm_lock);
+		}else{
+			cm_lk_hold_before = true;
+		}
+	}
+
+	unsigned len = coremap[index].cm_len;
+    if(coremap[index].cm_len >= 1){
+        for(unsigned i = 0; i < len; i++){
+            KASSERT(coremap[index + i].cm_status != Free);
+            cm_freelist_push(index + i);
+            coremap[index + i].cm_status = Free;
+			coremap[index + i].cm_pid = -1;
+			coremap[index + i].cm_isbusy = false;
+			coremap[index + i].cm_len = 0;
+			coremap[index + i].cm_refcount = 0;
+			coremap[index + i].cm_intlb = false;
+			coremap[index + i].cm_pte = NULL;
+			coremap[index + i].cm_as = NULL;
+			coremap[index + i].cm_shm = NULL;
+			coremap[index + i].cm_sec = 0;
+			coremap[index + i].cm_ref = false;
+        }
+    }
+
+	if(booted){
+		if(!cm_lk_hold_before){
+			spinlock_release(&cm_lock);
+		}
+	}
+
+}
+
+void
+user_free_onepage(vaddr_t addr)
+{
+	// (void)addr;
+    paddr_t paddr1 = addr - MIPS_KSEG0;
+    if(paddr1 > ram_getsize()){
+        return;
+    }
+    int index = paddr1 / PAGE_SIZE;
+
+    // synchronization
+	// used by user_release_page, which holds &cm_lock.
+	bool cm_lk_hold_before = false;
+	if(!spinlock_do_i_hold(&cm_lock)){
+		spinlock_acquire(&cm_lock);
+	}else{
+		cm_lk_hold_before = true;
+	}
+
+
+	KASSERT(coremap[index].cm_status != Free);
+	KASSERT(coremap[index].cm_cow == NULL);
+	cm_freelist_push(index);
+	coremap[index].cm_status = Free;
+	coremap[index].cm_pid = -1;
+	coremap[index].cm_isbusy = false;
+	coremap[index].cm_len = 0;
+	coremap[index].cm_refcount = 0;
+	coremap[index].cm_intlb = false;
+	coremap[index].cm_pte = NULL;
+	coremap[index].cm_as = NULL;
+	coremap[index].cm_shm = NULL;
+	coremap[index].cm_sec = 0;
+	coremap[index].cm_ref = false;
+	if(!cm_lk_hold_before){
+		spinlock_release(&cm_lock);
+	}
+}
+/*
+ * Links for the reverse map of copy-on-write frames. They are let go
+ * with cm_lock held, where kfree cannot be called, so they are kept
+ * here for the next fork instead. Protected by cm_lock.
+ */
+static struct cow_link * cow_links;
+
+struct cow_link *
+cow_link_get(void)
+{
+	struct cow_link * link;
+
+	KASSERT(!spinlock_do_i_hold(&cm_lock));
+	spinlock_acquire(&cm_lock);
+	link = cow_links;
+	if(link != NULL){
+		cow_links = link->cl_next;
+	}
+	spinlock_release(&cm_lock);
+	if(link == NULL){
+		link = kmalloc(sizeof(*link));
+	}
+	return link;
+}
+
+void
+cow_link_put(struct cow_link * link)
+{
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	link->cl_next = cow_links;
+	cow_links = link;
+}
+
+/*
+ * PTE, an entry of forked copy AS, shares the frame FROM maps, which
+ * LINK puts in the frame's reverse map. The zero frame has none: it is
+ * never evicted, and never anyone's to take over.
+ */
+void
+vm_cow_share(struct addrspace * as, struct pageTableNode * pte,
+	     struct pageTableNode * from, struct cow_link * link)
+{
+	unsigned k = from->pt_pas / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(!from->pt_inDisk && !from->pt_inFile);
+	pte->pt_pas = from->pt_pas;
+	pte->pt_isCow = true;
+	from->pt_isCow = true;
+	coremap[k].cm_refcount++;
+	if(k == zero_frame){
+		cow_link_put(link);
+		return;
+	}
+	KASSERT(coremap[k].cm_pte != NULL && coremap[k].cm_shm == NULL);
+	link->cl_as = as;
+	link->cl_pte = pte;
+	link->cl_next = coremap[k].cm_cow;
+	coremap[k].cm_cow = link;
+}
+
+/*
+ * PTE no longer maps frame K, which has other mappings left. If PTE
+ * was the one in cm_pte, the next on cm_cow takes its place, so the
+ * last mapping left owns the frame and it can be evicted again.
+ */
+static
+void
+cow_unlink(unsigned k, struct pageTableNode * pte)
+{
+	struct cow_link ** p, * link;
+
+	if(coremap[k].cm_pte == pte){
+		link = coremap[k].cm_cow;
+		KASSERT(link != NULL);
+		coremap[k].cm_pte = link->cl_pte;
+		coremap[k].cm_as = link->cl_as;
+		coremap[k].cm_cow = link->cl_next;
+	}else{
+		for(p = &coremap[k].cm_cow; *p != NULL; p = &(*p)->cl_next){
+			if((*p)->cl_pte == pte){
+				break;
 			}
 		}
-		return 0;
+		link = *p;
+		KASSERT(link != NULL);
+		*p = link->cl_next;
+	}
+	cow_link_put(link);
+}
+
+/*
+ * Drop PTE's reference to its frame or swap slot. A frame shared
+ * copy-on-write stays allocated until its last mapping goes away.
+ * Caller holds cm_lock and has waited for the frame to be not busy.
+ */
+void
+user_release_page(struct pageTableNode * pte)
+{
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	if(pte->pt_hasSlot){
+		swap_free(pte);
+	}
+	if(pte->pt_inDisk || pte->pt_inFile){
+		return;
+	}
+
+	unsigned index = pte->pt_pas / PAGE_SIZE;
+	KASSERT(coremap[index].cm_refcount > 0);
+	coremap[index].cm_refcount--;
+	if(coremap[index].cm_refcount == 0){
+		user_free_onepage(PADDR_TO_KVADDR(pte->pt_pas));
+	}else if(index != zero_frame){
+		cow_unlink(index, pte);
+	}
+}
+
+unsigned
+int
+coremap_used_bytes() {
+
+	/* a single read of the running free count; no need for cm_lock */
+    return (cm_num - cm_nfree) * PAGE_SIZE;
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+
+	bool cm_lk_hold_before = false;
+	if(!spinlock_do_i_hold(&cm_lock)){
+		spinlock_acquire(&cm_lock);
+	}else{
+		cm_lk_hold_before = true;
+	}
+
+	frame_tlb_invalidate_local(ts->ts_cmindex);
+	coremap[ts->ts_cmindex].cm_tlbcpus &= ~((uint32_t)1 << curcpu->c_number);
+	wchan_wakeall(tlb_wchan, &cm_lock);
+	if(!cm_lk_hold_before){
+		spinlock_release(&cm_lock);
+	}
+}
+
+/*
+ * The shootdown queue overflowed: flush the whole TLB and answer every
+ * request aimed at this cpu.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	uint32_t self = (uint32_t)1 << curcpu->c_number;
+
+	tlb_flush_local();
+
+	spinlock_acquire(&cm_lock);
+	for(unsigned k = 0; k < cm_num; k++){
+		coremap[k].cm_tlbcpus &= ~self;
+	}
+	tlb_stats.ts_flushall++;
+	wchan_wakeall(tlb_wchan, &cm_lock);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Bring PTE back from swap. The pages of the same address space that
+ * sit in the slots right after it are read in the same request, as
+ * long as that only uses frames that are free anyway.
+ */
+static
+int
+swap_in(struct addrspace * as, struct pageTableNode * pte)
+{
+	struct pageTableNode * batch[SWAP_CLUSTER];
+	vaddr_t kvaddrs[SWAP_CLUSTER];
+	struct pageTableNode * next;
+	unsigned n = 1, slot, k;
+
+	k = user_take_frame(NULL);
+	if(k == 0){
+		return ENOMEM;
+	}
+	//allocation may have slept; the slot is ours either way
+	KASSERT(pte->pt_inDisk && pte->pt_hasSlot);
+	KASSERT(bitmap_isset(vm_bitmap, pte->pt_bm_index) != 0);
+	slot = pte->pt_bm_index;
+	batch[0] = pte;
+	kvaddrs[0] = PADDR_TO_KVADDR(k * PAGE_SIZE);
+	coremap[k].cm_isbusy = true;
+
+	while(n < SWAP_CLUSTER && slot + n < swap_nslots && cm_nfree > vm_lowater){
+		next = swap_map[slot + n];
+		if(next == NULL || next == SWAP_RECLAIMED || next == SWAP_SHARED ||
+		   !next->pt_inDisk ||
+		   pt_lookup(as, next->pt_vas) != next){
+			break;
+		}
+		k = cm_freelist_take(1);
+		KASSERT(k != 0);
+		user_frame_init(k);
+		coremap[k].cm_isbusy = true;
+		batch[n] = next;
+		kvaddrs[n] = PADDR_TO_KVADDR(k * PAGE_SIZE);
+		n++;
+	}
+
+	if(block_io_cluster(kvaddrs, n, slot, UIO_READ)){
+		panic("block_read error in vm_fault\n");
+	}
+
+	//a slot still shared with a forked copy is left to the others,
+	//unless we were the last one
+	if(swap_map[slot] == SWAP_SHARED){
+		if(swap_refs[slot] == 1){
+			swap_map[slot] = pte;
+			swap_refs[slot] = 0;
+		}else{
+			swap_free(pte);
+		}
+	}
+
+	//keep the swap slots: until a page is written again, eviction can
+	//just drop it
+	for(unsigned i = 0; i < n; i++){
+		k = (kvaddrs[i] - MIPS_KSEG0) / PAGE_SIZE;
+		batch[i]->pt_pas = k * PAGE_SIZE;
+		batch[i]->pt_isDirty = false;
+		batch[i]->pt_inDisk = false;
+		batch[i]->pt_isCow = false;
+		KASSERT(coremap[k].cm_pid == curproc->p_PID);
+		coremap[k].cm_pte = batch[i];
+		coremap[k].cm_as = as;
+		coremap[k].cm_isbusy = false;
+		wakeup_page(k);
+	}
+	swapio_stats.ss_readahead += n - 1;
+	return 0;
+}
+
+/*
+ * Handle a fault on a page shared copy-on-write. If we are the last
+ * mapping left the frame is ours again (cow_unlink); reads of a
+ * still-shared frame map it read-only; writes copy it into a frame of
+ * our own.
+ */
+static
+int
+cow_fault(int faulttype, struct pageTableNode * pte, bool * writable)
+{
+	unsigned old = pte->pt_pas / PAGE_SIZE;
+	vaddr_t vaddr_tmp;
+
+	if(coremap[old].cm_refcount == 1){
+		KASSERT(coremap[old].cm_pte == pte && coremap[old].cm_cow == NULL);
+		coremap[old].cm_pid = curproc->p_PID;
+		pte->pt_isCow = false;
+		return 0;
+	}
+	if(faulttype == VM_FAULT_READ){
+		*writable = false;
+		return 0;
+	}
+
+	if(old == zero_frame){
+		//first write to a page only read so far: a fresh page will do
+		spinlock_release(&cm_lock);
+		vaddr_tmp = user_alloc_onepage();
+		spinlock_acquire(&cm_lock);
+		if(vaddr_tmp == 0){
+			return ENOMEM;
+		}
+		zero_stats.zs_copies++;
+	}else{
+		//keep old in place while we copy it with cm_lock dropped; the
+		//other mappings may go away meanwhile and make it evictable
+		coremap[old].cm_isbusy = true;
+		spinlock_release(&cm_lock);
+		vaddr_tmp = user_alloc_onepage();
+		if(vaddr_tmp != 0){
+			memmove((void *)vaddr_tmp, (const void *)PADDR_TO_KVADDR(pte->pt_pas), PAGE_SIZE);
+		}
+		spinlock_acquire(&cm_lock);
+		coremap[old].cm_isbusy = false;
+		wakeup_page(old);
+		if(vaddr_tmp == 0){
+			return ENOMEM;
+		}
+	}
+	user_release_page(pte);
+
+	pte->pt_pas = vaddr_tmp - MIPS_KSEG0;
+	pte->pt_isCow = false;
+	pte->pt_isDirty = true;
+	pte->pt_isFile = false;
+	coremap[pte->pt_pas / PAGE_SIZE].cm_pte = pte;
+	coremap[pte->pt_pas / PAGE_SIZE].cm_as = proc_getas();
+	return 0;
+}
+
+/*
+ * Give PTE, a page of shared segment SEG that is not in memory or swap,
+ * a frame: zeroed, or holding its page of the file if it is one that
+ * has not been written. Called with cm_lock and sg_lock held; cm_lock
+ * is dropped to allocate and read, but sg_lock keeps other processes
+ * off PTE, and the frame has no cm_pte meanwhile, so it cannot be
+ * evicted.
+ */
+static
+int
+shm_fill(struct shm_segment * seg, struct pageTableNode * pte)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kva;
+	size_t len;
+	unsigned k;
+	int result;
+
+	spinlock_release(&cm_lock);
+	kva = user_alloc_onepage();
+	if(kva == 0){
+		spinlock_acquire(&cm_lock);
+		return ENOMEM;
+	}
+	if(pte->pt_inFile){
+		KASSERT(seg->sg_vnode != NULL);
+		len = seg->sg_filesize - pte->pt_vas < PAGE_SIZE ?
+			seg->sg_filesize - pte->pt_vas : PAGE_SIZE;
+		uio_kinit(&iov, &u, (void *)kva, len, pte->pt_vas, UIO_READ);
+		//past the end of a file truncated since, the page stays zero
+		result = VOP_READ(seg->sg_vnode, &u);
+		if(result){
+			user_free_onepage(kva);
+			spinlock_acquire(&cm_lock);
+			return result;
+		}
+	}
+	spinlock_acquire(&cm_lock);
+	KASSERT(pte->pt_pas == 0 && !pte->pt_inDisk);
+	k = (kva - MIPS_KSEG0) / PAGE_SIZE;
+	pte->pt_pas = k * PAGE_SIZE;
+	if(pte->pt_inFile){
+		pte->pt_inFile = false;
+		pte->pt_isDirty = false;
+		file_stats.fs_pageins++;
+	}else{
+		pte->pt_isDirty = true;
+	}
+	coremap[k].cm_pte = pte;
+	coremap[k].cm_shm = seg;
+	return 0;
+}
+
+/*
+ * Read PTE's page in from the file backing region RI (an executable or
+ * an mmap'd file). The part of the page outside the file data stays
+ * zero (bss). Called with as_lock held but not cm_lock, since the read
+ * sleeps; nobody else changes a page that is not resident.
+ */
+static
+int
+file_in(struct addrspace * as, struct regionInfoNode * ri, struct pageTableNode * pte)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kva, start, end;
+	int result;
+
+	KASSERT(pte->pt_inFile && ri->as_vnode != NULL);
+	kva = user_alloc_onepage();
+	if(kva == 0){
+		return ENOMEM;
+	}
+
+	start = pte->pt_vas > ri->as_fileva ? pte->pt_vas : ri->as_fileva;
+	end = pte->pt_vas + PAGE_SIZE;
+	if(end > ri->as_fileva + ri->as_filesize){
+		end = ri->as_fileva + ri->as_filesize;
+	}
+	if(start < end){
+		uio_kinit(&iov, &u, (void *)(kva + (start - pte->pt_vas)), end - start,
+			  ri->as_offset + (start - ri->as_fileva), UIO_READ);
+		//past the end of a file truncated since, the page stays zero
+		result = VOP_READ(ri->as_vnode, &u);
+		if(result){
+			user_free_onepage(kva);
+			return result;
+		}
+	}
+
+	spinlock_acquire(&cm_lock);
+	pte->pt_pas = kva - MIPS_KSEG0;
+	pte->pt_inFile = false;
+	pte->pt_isDirty = false;
+	coremap[pte->pt_pas / PAGE_SIZE].cm_pte = pte;
+	coremap[pte->pt_pas / PAGE_SIZE].cm_as = as;
+	file_stats.fs_pageins++;
+	spinlock_release(&cm_lock);
+	return 0;
+}
+
+/*
+ * Write PTE's page back to the file behind shared mapping RI unless it
+ * has not been written since it came from there. A page out in swap is
+ * read into a spare frame first. Called with as_lock held (or the
+ * address space no longer in use) and without cm_lock.
+ */
+int
+vm_writeback(struct regionInfoNode * ri, struct pageTableNode * pte)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kva, start, end;
+	unsigned index = 0;
+	bool spare = false;
+	int result;
+
+	KASSERT(ri->as_vnode != NULL);
+	start = pte->pt_vas > ri->as_fileva ? pte->pt_vas : ri->as_fileva;
+	end = pte->pt_vas + PAGE_SIZE;
+	if(end > ri->as_fileva + ri->as_filesize){
+		end = ri->as_fileva + ri->as_filesize;
+	}
+	if(start >= end){
+		return 0;
+	}
+
+	spinlock_acquire(&cm_lock);
+	wait_page_if_busy(pte);
+	if(pte->pt_isFile || pte->pt_inFile){
+		spinlock_release(&cm_lock);
+		return 0;
+	}
+	if(pte->pt_inDisk){
+		spinlock_release(&cm_lock);
+		kva = user_alloc_onepage();
+		if(kva == 0){
+			return ENOMEM;
+		}
+		spare = true;
+		spinlock_acquire(&cm_lock);
+		result = block_read((void *)kva, pte->pt_bm_index * PAGE_SIZE);
+		spinlock_release(&cm_lock);
+		if(result){
+			user_free_onepage(kva);
+			return result;
+		}
+	}else{
+		//keep the frame in place while it is written out
+		index = pte->pt_pas / PAGE_SIZE;
+		kva = PADDR_TO_KVADDR(pte->pt_pas);
+		coremap[index].cm_isbusy = true;
+		spinlock_release(&cm_lock);
 	}
 
-	if(booted){
-		if(!cm_lk_hold_before){
-			spinlock_release(&cm_lock);
-		}
+	uio_kinit(&iov, &u, (void *)(kva + (start - pte->pt_vas)), end - start,
+		  ri->as_offset + (start - ri->as_fileva), UIO_WRITE);
+	result = VOP_WRITE(ri->as_vnode, &u);
+
+	if(spare){
+		user_free_onepage(kva);
+		spinlock_acquire(&cm_lock);
+	}else{
+		spinlock_acquire(&cm_lock);
+		coremap[index].cm_isbusy = false;
+		wakeup_page(index);
 	}
-	return PADDR_TO_KVADDR(pa);// no
+	if(result == 0){
+		file_stats.fs_writebacks++;
+	}
+	spinlock_release(&cm_lock);
+	return result;
 }
 
-
-vaddr_t
-user_alloc_onepage()
+/*
+ * The pages fault-around and prefetch may touch for a fault at VADDR:
+ * those of its region, or else of the heap or the stack.
+ */
+static
+void
+fault_span(struct addrspace * as, struct regionInfoNode * region, vaddr_t vaddr,
+	   vaddr_t * lo, vaddr_t * hi)
 {
-	paddr_t pa = 0;
-	//used in as_copy and vm_fault, they acquire &cm_lock first.
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
+	vaddr_t heap_end = as->heap_vbase + as->heap_vbound * PAGE_SIZE;
+
+	if(region != NULL){
+		*lo = region->as_vbase;
+		*hi = region->as_vbase + region->as_npages * PAGE_SIZE;
+	}else if(vaddr >= as->heap_vbase && vaddr < heap_end){
+		*lo = as->heap_vbase;
+		*hi = heap_end;
 	}else{
-		cm_lk_hold_before = true;
+		*lo = as->stack_vbase;
+		*hi = USERSTACK;
 	}
+}
 
-    for(unsigned i = cm_addr / PAGE_SIZE ; i < cm_num; i++){
-        if(coremap[i].cm_status == Free){
-			pa = i * PAGE_SIZE;
-            coremap[i].cm_status = Dirty;
-            coremap[i].cm_len = 1;
-			coremap[i].cm_pid = curproc->p_PID;
-			coremap[i].cm_isbusy = false;
-			coremap[i].cm_intlb = false;
-			coremap[i].cm_sec = 0;
-			bzero((void *)PADDR_TO_KVADDR(pa), 1 * PAGE_SIZE);
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
+/*
+ * Note a fault at VADDR on PTE. If fault-around had mapped PTE, its
+ * entry was pushed out before it was used. If the fault is a little
+ * past the previous one, the pages stepped over that fault-around had
+ * mapped were used without faulting: those are the faults avoided.
+ * Faults moving the same way one after another make a sequential run.
+ * Only as_lock is needed: pt_ahead is only ever changed under it. The
+ * counts go into *MISSED and *AVOIDED for the caller to add to
+ * around_stats under cm_lock.
+ */
+static
+void
+fault_track(struct addrspace * as, struct pageTableNode * pte, vaddr_t vaddr,
+	    unsigned * missed, unsigned * avoided)
+{
+	const vaddr_t span = (FAULT_AROUND + FAULT_AHEAD_MAX) * PAGE_SIZE;
+	vaddr_t last = as->as_lastfault, va;
+	struct pageTableNode * p;
+	int dir = 0;
+
+	if(pte->pt_ahead){
+		pte->pt_ahead = false;
+		(*missed)++;
+	}
+	if(vaddr > last && vaddr - last <= span){
+		dir = 1;
+	}else if(vaddr < last && last - vaddr <= span){
+		dir = -1;
+	}
+	if(dir != 0){
+		for(va = last + dir * PAGE_SIZE; va != vaddr; va += dir * PAGE_SIZE){
+			p = pt_lookup(as, va);
+			if(p != NULL && p->pt_ahead){
+				p->pt_ahead = false;
+				(*avoided)++;
+				curproc->p_faultsavoided++;
 			}
-	        return PADDR_TO_KVADDR(pa);
-        }
-    }
-	//try swap_out
-	pa = swap_out(Dirty, 1);
-	if(pa == 0){
-		if(!cm_lk_hold_before){
-			spinlock_release(&cm_lock);
 		}
-		return 0;
 	}
-	bzero((void *)PADDR_TO_KVADDR(pa), 1 * PAGE_SIZE);
-	if(!cm_lk_hold_before){
-		spinlock_release(&cm_lock);
+	if(dir != 0 && dir == as->as_seqdir){
+		as->as_seqrun++;
+	}else{
+		as->as_seqdir = dir;
+		as->as_seqrun = dir != 0;
 	}
-	return PADDR_TO_KVADDR(pa);
+	as->as_lastfault = vaddr;
 }
 
-void
-free_kpages(vaddr_t addr)
+/*
+ * Make the untouched page at VADDR resident ahead of a sequential run:
+ * swap it in, or give it a frame from the zeroed pool. Nothing is
+ * evicted or zeroed for it; if that would be needed, or the page is
+ * not one we can fill, return false. Called with as_lock and cm_lock
+ * held; cm_lock is dropped to allocate a page table entry.
+ */
+static
+bool
+prefetch_page(struct addrspace * as, struct regionInfoNode * region, vaddr_t vaddr)
 {
-	// (void)addr;
-    paddr_t paddr1 = addr - MIPS_KSEG0;
-    if(paddr1 > ram_getsize()){
-        return;
-    }
-    int index = paddr1 / PAGE_SIZE;
+	struct pageTableNode * pte;
+	bool zeroed;
+	unsigned k;
+	int result;
 
-    // synchronization
-	//spinlock_acquire
-	//1. &cm_lock:
-	bool cm_lk_hold_before = false;
-	if(booted){
-		if(!spinlock_do_i_hold(&cm_lock)){
-			spinlock_acquire(&cm_lock);
-		}else{
-			cm_lk_hold_before = true;
+	pte = pt_lookup(as, vaddr);
+	if(pte == NULL && pt_isreclaimed(as, vaddr)){
+		spinlock_release(&cm_lock);
+		result = vm_pt_expand(as, vaddr);
+		spinlock_acquire(&cm_lock);
+		if(result){
+			return false;
 		}
+		pte = pt_lookup(as, vaddr);
 	}
-
-	unsigned len = coremap[index].cm_len;
-    if(coremap[index].cm_len >= 1){
-        for(unsigned i = 0; i < len; i++){
-            coremap[index + i].cm_status = Free;
-			coremap[index + i].cm_pid = -1;
-			coremap[index + i].cm_isbusy = false;
-			coremap[index + i].cm_len = 0;
-			coremap[index + i].cm_intlb = false;
-			coremap[index + i].cm_pte = NULL;
-			coremap[index + i].cm_sec = 0;
-        }
-    }
-
-	if(booted){
-		if(!cm_lk_hold_before){
-			spinlock_release(&cm_lock);
+	if(pte != NULL){
+		wait_page_if_busy(pte);
+		if(pte->pt_inDisk){
+			if(cm_nfree <= vm_lowater || swap_in(as, pte)){
+				return false;
+			}
+			around_stats.fa_swapins++;
+			return true;
 		}
+		return !pte->pt_inFile;
 	}
-
-}
-
-void
-user_free_onepage(vaddr_t addr)
-{
-	// (void)addr;
-    paddr_t paddr1 = addr - MIPS_KSEG0;
-    if(paddr1 > ram_getsize()){
-        return;
-    }
-    int index = paddr1 / PAGE_SIZE;
-
-    // synchronization
-	// used in as_destroy, as_destroy acquires &cm_lock first.
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
-	}else{
-		cm_lk_hold_before = true;
+	//only anonymous memory is zero-filled
+	if(region != NULL && region->as_vnode != NULL &&
+	   vaddr < region->as_fileva + region->as_filesize &&
+	   vaddr + PAGE_SIZE > region->as_fileva){
+		return false;
 	}
-
-
-	coremap[index].cm_status = Free;
-	coremap[index].cm_pid = -1;
-	coremap[index].cm_isbusy = false;
-	coremap[index].cm_len = 0;
-	coremap[index].cm_intlb = false;
-	coremap[index].cm_pte = NULL;
-	coremap[index].cm_sec = 0;
-	if(!cm_lk_hold_before){
-		spinlock_release(&cm_lock);
+	if(cm_nzero == 0 || cm_nfree <= vm_lowater){
+		return false;
 	}
-}
-unsigned
-int
-coremap_used_bytes() {
 
-	/* dumbvm doesn't track page allocations. Return 0 so that khu works. */
-    unsigned int res = 0;
-	//spinlock_acquire
-	//1. &cm_lock:
-	bool cm_lk_hold_before = false;
-	if(booted){
-		if(!spinlock_do_i_hold(&cm_lock)){
-			spinlock_acquire(&cm_lock);
-		}else{
-			cm_lk_hold_before = true;
+	spinlock_release(&cm_lock);
+	pte = pte_alloc();
+	if(pte != NULL){
+		pte->pt_vas = vaddr;
+		pte->pt_pas = 0;
+		pte->pt_isDirty = true;
+		pte->pt_inDisk = false;
+		pte->pt_isCow = false;
+		pte->pt_hasSlot = false;
+		pte->pt_bm_index = 0;
+		pte->pt_isFile = false;
+		pte->pt_inFile = false;
+		pte->pt_ahead = false;
+		if(pt_insert(as, pte)){
+			pte_free(pte);
+			pte = NULL;
 		}
 	}
-    for(unsigned i = 0; i < ram_getsize()/PAGE_SIZE; i++){
-        if(coremap[i].cm_status != Free){
-            res++;
-        }
-    }
-	if(booted){
-		if(!cm_lk_hold_before){
-			spinlock_release(&cm_lock);
-		}
+	spinlock_acquire(&cm_lock);
+	if(pte == NULL){
+		return false;
+	}
+	if(cm_nzero == 0){
+		//used up while we were allocating
+		spinlock_release(&cm_lock);
+		pt_remove(as, vaddr);
+		pte_free(pte);
+		spinlock_acquire(&cm_lock);
+		return false;
 	}
-    return res*PAGE_SIZE;
+	k = user_take_frame(&zeroed);
+	KASSERT(k != 0 && zeroed);
+	zero_stats.zs_hits++;
+	pte->pt_pas = k * PAGE_SIZE;
+	coremap[k].cm_pte = pte;
+	coremap[k].cm_as = as;
+	around_stats.fa_zerofills++;
+	return true;
 }
 
+/*
+ * After a fault at VADDR has been handled, load TLB entries for the
+ * resident pages near it, so the ones about to be touched do not each
+ * take a fault of their own: the pages a sequential run is heading
+ * for, brought in first if need be, or else the aligned block of
+ * FAULT_AROUND pages around VADDR. Entries are loaded as a fault would
+ * load them, read-only unless the page is dirty and not shared.
+ * Called with as_lock and cm_lock held.
+ */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+fault_ahead(struct addrspace * as, struct regionInfoNode * region, vaddr_t vaddr)
 {
-
-	int spl;
-	uint32_t ehi, elo;
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
+	vaddr_t lo, hi, start, end, va;
+	struct pageTableNode * pte;
+	unsigned n = 0, k;
+	bool canwrite;
+
+	fault_span(as, region, vaddr, &lo, &hi);
+	if(as->as_seqrun >= 2){
+		//run further ahead the longer the run has gone on
+		while(n < as->as_seqrun && n < FAULT_AHEAD_MAX){
+			va = vaddr + as->as_seqdir * (int)((n + 1) * PAGE_SIZE);
+			if(va < lo || va >= hi || !prefetch_page(as, region, va)){
+				break;
+			}
+			n++;
+		}
+		if(as->as_seqdir > 0){
+			start = vaddr + PAGE_SIZE;
+			end = start + n * PAGE_SIZE;
+		}else{
+			end = vaddr;
+			start = end - n * PAGE_SIZE;
+		}
 	}else{
-		cm_lk_hold_before = true;
+		start = vaddr & ~(vaddr_t)(FAULT_AROUND * PAGE_SIZE - 1);
+		end = start + FAULT_AROUND * PAGE_SIZE;
 	}
-
-	spl = splhigh();
-	elo = ts->ts_placeholder;
-	ehi = 0;
-	int i = tlb_probe(ehi, elo);
-	if(i >= 0){
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if(start < lo){
+		start = lo;
 	}
-	coremap[ts->ts_cmindex].cm_intlb = false;
-	splx(spl);
-	wchan_wakeall(tlb_wchan, &cm_lock);
-	if(!cm_lk_hold_before){
-		spinlock_release(&cm_lock);
+	if(end > hi){
+		end = hi;
+	}
+
+	canwrite = region == NULL || region->as_mapflags == 0 ||
+		(region->as_permission & PF_W);
+	for(va = start; va < end; va += PAGE_SIZE){
+		if(va == vaddr){
+			continue;
+		}
+		pte = pt_lookup(as, va);
+		if(pte == NULL || pte->pt_inDisk || pte->pt_inFile || pte->pt_pas == 0){
+			continue;
+		}
+		k = pte->pt_pas / PAGE_SIZE;
+		if(coremap[k].cm_isbusy){
+			continue;
+		}
+		tlb_load(va, pte->pt_pas, canwrite && pte->pt_isDirty && !pte->pt_isCow);
+		coremap[k].cm_intlb = true;
+		pte->pt_ahead = true;
+		around_stats.fa_mapped++;
 	}
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase, vtop, stackbase, stacktop;
+	vaddr_t stacktop;
 	paddr_t paddr1 = 0x0;
 	struct addrspace *as;
+	bool writable = true, again = false, major = false, growstack = false;
+	unsigned k, missed = 0, avoided = 0;
+	int result;
 
 	faultaddress &= PAGE_FRAME;
 
 	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("vm: got VM_FAULT_READONLY\n");
+	    case VM_FAULT_READONLY://0x2 write to a copy-on-write page
 	    case VM_FAULT_READ://0x0
 	    case VM_FAULT_WRITE://0x1
 		break;
@@ -515,176 +2577,247 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	// faultaddress should belong to one regions
 
-	stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 	if(faultaddress >= stacktop){
 		return EFAULT;
 	}
-	if(faultaddress >= as->heap_vbase + as->heap_vbound * PAGE_SIZE && faultaddress < stackbase){
-		return EFAULT;
-	}
 
 	// stack or heap:
 	// do nothing in this step and skip to create new pte.
 	// non-stack:
 
-	struct regionInfoNode * tmp = as->regionInfo;
-	//faultaddress should be only in non-stack non-heap regions.
-	if(faultaddress < as->heap_vbase){
-		while(tmp != NULL){
-			////KASSERT
-			//KASSERT(tmp->as_vbase != 0);
-			//KASSERT((tmp->as_vbase & PAGE_FRAME) == tmp->as_vbase);
-			//base & bounds
-			vbase = tmp->as_vbase;
-			vtop = vbase + tmp->as_npages * PAGE_SIZE;
-			if(faultaddress >= vbase && faultaddress < vtop){
-				break;
-			}else{
-				tmp = tmp->next;
+	struct regionInfoNode * region = NULL;
+	//faultaddress should be only in non-stack non-heap regions, or
+	//in an mmap region between the heap and the stack, or just below
+	//the stack, which then grows down to it.
+	if(faultaddress < as->heap_vbase ||
+	   (faultaddress >= as->heap_vbase + as->heap_vbound * PAGE_SIZE && faultaddress < as->stack_vbase)){
+		region = as_region_lookup(as, faultaddress);
+		if(region == NULL){
+			if(faultaddress < as_stack_floor(as)){
+				// kprintf("vm.c invalid faultaddress");
+				return EFAULT;// invalid faultaddress
+			}
+			//the stack grows down to it once the fault has worked
+			growstack = true;
+		}else if(region->as_mapflags != 0){
+			//mmap protections are enforced; MIPS cannot map write-only
+			if(region->as_permission == 0){
+				return EFAULT;
+			}
+			if(!(region->as_permission & PF_W)){
+				if(faulttype != VM_FAULT_READ){
+					return EFAULT;
+				}
+				writable = false;
 			}
-		}
-		if(tmp == NULL){
-			// kprintf("vm.c invalid faultaddress");
-			return EFAULT;// invalid faultaddress
 		}
 	}
 
-	//spinlock_acquire
-	//1. &cm_lock:
-	bool cm_lk_hold_before = false;
-	if(!spinlock_do_i_hold(&cm_lock)){
-		spinlock_acquire(&cm_lock);
+	//1. as_lock: the page table only changes under it, so the entry
+	//we find stays ours until we are done. The entries of a shared
+	//segment are the segment's, and faults on them from any process
+	//go one at a time under sg_lock instead.
+	lock_acquire(as->as_lock);
+
+	struct pageTableNode * ptTmp;
+	struct shm_segment * seg = NULL;
+	if(region != NULL && region->as_shm != NULL){
+		seg = region->as_shm;
+		lock_acquire(seg->sg_lock);
+		ptTmp = shm_page(seg, (faultaddress - region->as_fileva) / PAGE_SIZE);
+		if(ptTmp == NULL){
+			lock_release(seg->sg_lock);
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
 	}else{
-		cm_lk_hold_before = true;
-	}
-	//2. as_ptLock:
-	// bool pt_lk_hold_before = false;
-	// if(!spinlock_do_i_hold(as->as_ptLock)){
-	// 	spinlock_acquire(as->as_ptLock);
-	// }else{
-	// 	pt_lk_hold_before = true;
-	// }
-
-	struct pageTableNode * ptTmp = as->pageTable;
-	bool found = 0;
-	while(ptTmp != NULL){
-		if(ptTmp->pt_vas == faultaddress){
-			found = 1;
-			break;
+		//an entry reclaimed while the page was out in swap comes back
+		if(vm_pt_expand(as, faultaddress)){
+			lock_release(as->as_lock);
+			return ENOMEM;
 		}
-		ptTmp = ptTmp->next;
+		ptTmp = pt_lookup(as, faultaddress);
 	}
 
-	if(found == 1){
-
-		//1. check ptTmp status
-		wait_page_if_busy(ptTmp->pt_pas / PAGE_SIZE);
-
-		if(ptTmp->pt_inDisk){
-			//1.1 if in disk, user_alloc_onepage, then swap in
-			vaddr_t vaddr_tmp = user_alloc_onepage();
-			if(vaddr_tmp == 0){
-				if(!cm_lk_hold_before){
-					spinlock_release(&cm_lock);
-				}
-				return ENOMEM;
-			}
-
-
-			ptTmp->pt_pas = vaddr_tmp - MIPS_KSEG0;
-			paddr1 = ptTmp->pt_pas;
-
-			coremap[paddr1 / PAGE_SIZE].cm_isbusy = true;
-
-			//KASSERT((paddr1 & PAGE_FRAME) == paddr1);
-
-			KASSERT(bitmap_isset(vm_bitmap, ptTmp->pt_bm_index) != 0);
-
-			if(block_read((void *)PADDR_TO_KVADDR(paddr1), ptTmp->pt_bm_index * PAGE_SIZE)){
-				panic("block_read error in vm_fault\n");
-			}
-
-			//2 change status
-			bitmap_unmark(vm_bitmap, ptTmp->pt_bm_index);
-			// ptTmp->pt_isDirty = true;
-			ptTmp->pt_bm_index = 0;
-
-			ptTmp->pt_inDisk = false;
-
-			KASSERT(coremap[paddr1 / PAGE_SIZE].cm_pid == curproc->p_PID);
-			KASSERT((paddr1 & PAGE_FRAME) == paddr1);
-			coremap[paddr1 / PAGE_SIZE].cm_pte = ptTmp;
-			coremap[paddr1 / PAGE_SIZE].cm_isbusy = false;
-			wchan_wakeall(cm_wchan, &cm_lock);
-
-
-		}else{
-			//1.2 if in memory
-			paddr1 = ptTmp->pt_pas;
+	if(ptTmp == NULL){
+		if(faulttype == VM_FAULT_READONLY){
+			lock_release(as->as_lock);
+			return EFAULT;
 		}
-	}else{
-		//create
+		//create; nothing else can see the entry until it has a frame,
+		//so build it with cm_lock released
 		struct pageTableNode * newpt;
-		newpt = (struct pageTableNode *)kmalloc(sizeof(struct pageTableNode));
+		newpt = pte_alloc();
+		if(newpt == NULL && vm_pt_reclaim(as) > 0){
+			//freed some of our own entries; try once more
+			newpt = pte_alloc();
+		}
 		if(newpt == NULL){
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
-			}
+			lock_release(as->as_lock);
 			return ENOMEM;
 		}
 		newpt->pt_vas = faultaddress;
-		// newpt->pt_isDirty = true;
+		newpt->pt_pas = 0;
+		newpt->pt_isDirty = true;
 		newpt->pt_inDisk = false;
+		newpt->pt_isCow = false;
+		newpt->pt_hasSlot = false;
 		newpt->pt_bm_index = 0;
-		vaddr_t vaddr_tmp = user_alloc_onepage();//alloc_kpages(1);
-		// kprintf("%x\n", vaddr_tmp);
-		if(vaddr_tmp == 0){
-			kfree(newpt);
-			if(!cm_lk_hold_before){
-				spinlock_release(&cm_lock);
-			}
+		newpt->pt_isFile = false;
+		newpt->pt_inFile = false;
+		newpt->pt_ahead = false;
+		if(pt_insert(as, newpt)){
+			pte_free(newpt);
+			lock_release(as->as_lock);
 			return ENOMEM;
 		}
-		newpt->pt_pas = vaddr_tmp - MIPS_KSEG0;
-		paddr1 = newpt->pt_pas;
-		coremap[paddr1 / PAGE_SIZE].cm_pte = newpt;
-		newpt->next = as->pageTable;
-		as->pageTable = newpt;
+		if(region != NULL && region->as_vnode != NULL &&
+		   faultaddress < region->as_fileva + region->as_filesize &&
+		   faultaddress + PAGE_SIZE > region->as_fileva){
+			//a page of the executable: read in below
+			newpt->pt_isDirty = false;
+			newpt->pt_isFile = true;
+			newpt->pt_inFile = true;
+			spinlock_acquire(&cm_lock);
+		}else if(faulttype == VM_FAULT_READ){
+			//only read so far: share the zero frame until written
+			spinlock_acquire(&cm_lock);
+			newpt->pt_pas = zero_frame * PAGE_SIZE;
+			newpt->pt_isDirty = false;
+			newpt->pt_isCow = true;
+			coremap[zero_frame].cm_refcount++;
+			zero_stats.zs_maps++;
+		}else{
+			vaddr_t vaddr_tmp = user_alloc_onepage();
+			if(vaddr_tmp == 0){
+				pt_remove(as, faultaddress);
+				pte_free(newpt);
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+			spinlock_acquire(&cm_lock);
+			newpt->pt_pas = vaddr_tmp - MIPS_KSEG0;
+			coremap[newpt->pt_pas / PAGE_SIZE].cm_pte = newpt;
+			coremap[newpt->pt_pas / PAGE_SIZE].cm_as = as;
+		}
+		ptTmp = newpt;
+	}else{
+		spinlock_acquire(&cm_lock);
+	}
+
+	//2. cm_lock: to see what the page needs and bring it in, which
+	//takes frames off the free lists
+	vm_stats[vm_policy].vs_faults++;
 
+	wait_page_if_busy(ptTmp);
+	if(ptTmp->pt_inFile && seg == NULL){
+		//2.0 a page of the executable not read in yet (or dropped)
+		KASSERT(region != NULL);
+		spinlock_release(&cm_lock);
+		result = file_in(as, region, ptTmp);
+		spinlock_acquire(&cm_lock);
+		major = true;
+	}else if(ptTmp->pt_inDisk){
+		//2.1 if in disk, swap in (with read-ahead)
+		result = swap_in(as, ptTmp);
+		major = true;
+		if(result == 0 && seg != NULL){
+			coremap[ptTmp->pt_pas / PAGE_SIZE].cm_as = NULL;
+			coremap[ptTmp->pt_pas / PAGE_SIZE].cm_shm = seg;
+		}
+	}else if(ptTmp->pt_pas == 0){
+		//2.2 a page of a shared segment nobody has touched yet, or
+		//a clean page of its file that was dropped
+		KASSERT(seg != NULL);
+		result = shm_fill(seg, ptTmp);
+	}else if(ptTmp->pt_isCow){
+		//2.3 if in memory and shared with a forked copy
+		result = cow_fault(faulttype, ptTmp, &writable);
+	}else{
+		//2.4 if in memory: only the TLB entry was missing
+		tlb_stats.ts_refills++;
+		result = 0;
+	}
+	//as_lock covers the counts (getrusage)
+	if(major){
+		curproc->p_majflt++;
+	}else{
+		curproc->p_minflt++;
+	}
+	if(result == 0){
+		//file_in drops cm_lock on its way out, so the page may be on
+		//its way out again already; then the access just faults again
+		wait_page_if_busy(ptTmp);
+		if(ptTmp->pt_inDisk || ptTmp->pt_inFile || ptTmp->pt_pas == 0){
+			again = true;
+		}
+	}
+	if(result || again){
+		spinlock_release(&cm_lock);
+		if(seg != NULL){
+			lock_release(seg->sg_lock);
+		}
+		lock_release(as->as_lock);
+		return result;
+	}
+	paddr1 = ptTmp->pt_pas;
+	k = paddr1 / PAGE_SIZE;
+	if(growstack && faultaddress < as->stack_vbase){
+		as->stack_vbase = faultaddress;
 	}
 
+	//3. the frame is marked busy for the rest, so it cannot be evicted
+	//before the eviction would see cm_intlb, and its state is ours to
+	//change without cm_lock; as_lock (sg_lock) keeps the entry still.
+	//The zero frame is never evicted and too widely shared to lock.
+	if(k != zero_frame){
+		coremap[k].cm_isbusy = true;
+	}
+	spinlock_release(&cm_lock);
 
+	if(seg == NULL){
+		fault_track(as, ptTmp, faultaddress, &missed, &avoided);
+	}
 
-	//update TLB
-	/* make sure it's page-aligned */
-	//KASSERT((paddr1 & PAGE_FRAME) == paddr1);
-	int spl;
-	uint32_t ehi, elo;
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-	ehi = faultaddress;
-	elo = paddr1;
-	int i = tlb_probe(ehi, elo);
-	if(i >= 0){
-		tlb_write(ehi, elo | TLBLO_DIRTY | TLBLO_VALID, i);
-		splx(spl);
-	}else{
-		tlb_random(ehi, elo | TLBLO_DIRTY | TLBLO_VALID);
-		splx(spl);
+	//clean pages are mapped read-only, so the first write faults
+	//(VM_FAULT_READONLY) and marks them dirty here
+	if(writable && !ptTmp->pt_isDirty){
+		if(faulttype == VM_FAULT_READ){
+			writable = false;
+		}else{
+			ptTmp->pt_isDirty = true;
+			ptTmp->pt_isFile = false;
+		}
 	}
 
-	coremap[paddr1 / PAGE_SIZE].cm_intlb = true;
+	tlb_load(faultaddress, paddr1, writable);
+
 	struct timespec ts;
 	gettime(&ts);
-	coremap[paddr1 / PAGE_SIZE].cm_sec = ts.tv_sec;
-	// spinlock_release
-	// if(!pt_lk_hold_before){
-	// 	spinlock_release(as->as_ptLock);
-	// }
-	if(!cm_lk_hold_before){
-		// wchan_wakeall(cm_wchan, &cm_lock);
-		spinlock_release(&cm_lock);
+	if(k != zero_frame){
+		coremap[k].cm_intlb = true;
+		coremap[k].cm_sec = ts.tv_sec;
+		coremap[k].cm_ref = true;
+	}
+
+	//4. map the neighbours too, and run ahead of a sequential scan
+	spinlock_acquire(&cm_lock);
+	if(k != zero_frame){
+		coremap[k].cm_isbusy = false;
+		wakeup_page(k);
+	}else{
+		coremap[k].cm_intlb = true;
+	}
+	around_stats.fa_missed += missed;
+	around_stats.fa_avoided += avoided;
+	if(seg == NULL){
+		fault_ahead(as, region, faultaddress);
+	}
+	spinlock_release(&cm_lock);
+	if(seg != NULL){
+		lock_release(seg->sg_lock);
 	}
+	lock_release(as->as_lock);
 	return 0;
 }
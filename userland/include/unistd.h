@@ -40,9 +40,12 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
+#include <kern/shm.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* needs struct timeval */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -62,6 +65,13 @@
  * header files as well, as follows:
  *
  *     waitpid:  sys/wait.h
+ *     mmap:     sys/mman.h
+ *     munmap:   sys/mman.h
+ *     shmget:   sys/shm.h
+ *     shmat:    sys/shm.h
+ *     shmdt:    sys/shm.h
+ *     shmctl:   sys/shm.h
+ *     getrusage: sys/resource.h
  *     open:     fcntl.h or sys/fcntl.h
  *     reboot:   sys/reboot.h
  *     ioctl:    sys/ioctl.h
@@ -141,6 +151,14 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int shmget(int key, size_t size, int flags);
+void *shmat(int shmid, const void *addr, int flags);
+int shmdt(const void *addr);
+int shmctl(int shmid, int cmd, void *buf);
+int getrusage(int who, struct rusage *usage);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c
+ *
+ * Checks mmap and munmap: a private file mapping sees the file and
+ * keeps its own writes, a shared one writes back to the file on
+ * munmap, and an anonymous one starts zero-filled. Shared mappings
+ * stay shared across fork, and the file ends up with the last write
+ * whichever side unmaps last. Then times reading a file through a
+ * mapping against read() into a buffer.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PageSize	4096
+#define NumPages	64		/* 256K test file */
+#define FileSize	(NumPages * PageSize)
+#define FileName	"mmaptest.dat"
+
+static char buf[PageSize];
+
+static
+char
+pattern(int off)
+{
+	return 'a' + (off / PageSize + off) % 26;
+}
+
+static
+void
+makefile(void)
+{
+	int fd, i, j;
+
+	fd = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FileName);
+	}
+	for (i = 0; i < NumPages; i++) {
+		for (j = 0; j < PageSize; j++) {
+			buf[j] = pattern(i * PageSize + j);
+		}
+		if (write(fd, buf, PageSize) != PageSize) {
+			err(1, "%s: write", FileName);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+private_map(void)
+{
+	char *p;
+	int fd, i;
+
+	fd = open(FileName, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FileName);
+	}
+	p = mmap(NULL, FileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	close(fd);
+	for (i = 0; i < FileSize; i += 97) {
+		if (p[i] != pattern(i)) {
+			errx(1, "private: byte %d is %c, not %c",
+			     i, p[i], pattern(i));
+		}
+	}
+	p[0] = '!';
+	if (munmap(p, FileSize)) {
+		err(1, "munmap private");
+	}
+
+	fd = open(FileName, O_RDONLY);
+	if (fd < 0 || read(fd, buf, 1) != 1) {
+		err(1, "%s: reread", FileName);
+	}
+	close(fd);
+	if (buf[0] != pattern(0)) {
+		errx(1, "private: write reached the file");
+	}
+	printf("private mapping: ok\n");
+}
+
+static
+void
+shared_map(void)
+{
+	char *p;
+	int fd;
+
+	fd = open(FileName, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FileName);
+	}
+	p = mmap(NULL, FileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	p[5 * PageSize] = '#';
+	if (munmap(p, FileSize)) {
+		err(1, "munmap shared");
+	}
+
+	if (lseek(fd, 5 * PageSize, SEEK_SET) < 0 || read(fd, buf, 2) != 2) {
+		err(1, "%s: reread", FileName);
+	}
+	close(fd);
+	if (buf[0] != '#' || buf[1] != pattern(5 * PageSize + 1)) {
+		errx(1, "shared: write not in the file");
+	}
+	printf("shared mapping: ok\n");
+}
+
+/*
+ * The child writes a page, which the parent must see. The parent then
+ * writes another page and unmaps while the child still has the file
+ * mapped, so the child's unmap at exit is the last one: the file has
+ * to get the parent's write, not what the page held at fork.
+ */
+static
+void
+shared_fork(void)
+{
+	volatile char *p, *flags;
+	int fd, status;
+	pid_t pid;
+
+	fd = open(FileName, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FileName);
+	}
+	p = mmap(NULL, FileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	flags = mmap(NULL, PageSize, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED || flags == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	p[9 * PageSize] = '&';
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[7 * PageSize] = '%';
+		flags[0] = 1;
+		while (flags[1] == 0) {
+			/* wait for the parent's write */
+		}
+		_exit(0);
+	}
+
+	while (flags[0] == 0) {
+		/* wait for the child's write */
+	}
+	if (p[7 * PageSize] != '%') {
+		errx(1, "shared fork: parent does not see the child's write");
+	}
+	p[9 * PageSize] = '@';
+	if (munmap((void *)p, FileSize)) {
+		err(1, "munmap shared");
+	}
+	flags[1] = 1;
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "shared fork: child failed");
+	}
+	munmap((void *)flags, PageSize);
+
+	if (lseek(fd, 7 * PageSize, SEEK_SET) < 0 || read(fd, buf, 1) != 1 ||
+	    lseek(fd, 9 * PageSize, SEEK_SET) < 0 || read(fd, buf + 1, 1) != 1) {
+		err(1, "%s: reread", FileName);
+	}
+	close(fd);
+	if (buf[0] != '%') {
+		errx(1, "shared fork: child's write not in the file");
+	}
+	if (buf[1] != '@') {
+		errx(1, "shared fork: parent's write lost, file has %c",
+		     buf[1]);
+	}
+	printf("shared mapping across fork: ok\n");
+}
+
+static
+void
+anon_map(void)
+{
+	char *p;
+	int i;
+
+	p = mmap(NULL, NumPages * PageSize, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anon");
+	}
+	for (i = 0; i < NumPages * PageSize; i += 512) {
+		if (p[i] != 0) {
+			errx(1, "anon: byte %d not zero", i);
+		}
+		p[i] = 1;
+	}
+	/* unmap the middle, then each end */
+	if (munmap(p + PageSize, PageSize) ||
+	    munmap(p, PageSize) ||
+	    munmap(p + 2 * PageSize, (NumPages - 2) * PageSize)) {
+		err(1, "munmap anon");
+	}
+	printf("anonymous mapping: ok\n");
+}
+
+static
+unsigned long
+msecs_since(time_t secs, unsigned long nsecs)
+{
+	time_t nowsecs;
+	unsigned long nownsecs, ms;
+
+	__time(&nowsecs, &nownsecs);
+	ms = (nowsecs - secs) * 1000;
+	ms = ms + nownsecs / 1000000 - nsecs / 1000000;
+	return ms == 0 ? 1 : ms;
+}
+
+static
+void
+timing(void)
+{
+	time_t secs;
+	unsigned long nsecs, ms;
+	unsigned sum1 = 0, sum2 = 0;
+	char *p;
+	int fd, i, j;
+
+	fd = open(FileName, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FileName);
+	}
+
+	__time(&secs, &nsecs);
+	for (i = 0; i < NumPages; i++) {
+		if (read(fd, buf, PageSize) != PageSize) {
+			err(1, "%s: read", FileName);
+		}
+		for (j = 0; j < PageSize; j += 64) {
+			sum1 += buf[j];
+		}
+	}
+	ms = msecs_since(secs, nsecs);
+	printf("read():  %d pages in %lu ms\n", NumPages, ms);
+
+	__time(&secs, &nsecs);
+	p = mmap(NULL, FileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	for (i = 0; i < FileSize; i += 64) {
+		sum2 += p[i];
+	}
+	munmap(p, FileSize);
+	ms = msecs_since(secs, nsecs);
+	printf("mmap():  %d pages in %lu ms\n", NumPages, ms);
+
+	close(fd);
+	if (sum1 != sum2) {
+		errx(1, "read and mmap saw different data");
+	}
+}
+
+int
+main(void)
+{
+	makefile();
+	private_map();
+	shared_map();
+	shared_fork();
+	anon_map();
+	timing();
+	remove(FileName);
+	printf("mmaptest: passed\n");
+	return 0;
+}
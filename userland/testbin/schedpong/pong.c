@@ -30,9 +30,19 @@
 
 /*
  * Semaphore pong.
+ *
+ * The cyclic passes also measure wakeup-to-run latency: each ponger
+ * notes the time just before it wakes the next one and just after it
+ * is woken itself. The two are paired up afterwards, in the task
+ * director, and the percentiles printed.
  */
 
+#include <sys/types.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <err.h>
 #include <assert.h>
 
@@ -46,6 +56,17 @@
 static struct usem sems[MAXCOUNT];
 static unsigned nsems;
 
+/*
+ * Timestamps of the cyclic passes, in nanoseconds. The Nth wakeup of
+ * a ponger was caused by the Nth V of the one before it in the ring.
+ * Each ponger writes its arrays to the group's times file at the
+ * offset for its id.
+ */
+#define NSTAMPS (2 * PONGLOOPS)
+static uint64_t sendtimes[NSTAMPS], waketimes[NSTAMPS];
+static unsigned nsends, nwakes;
+static char timesfile[32];
+
 /*
  * Set up the semaphores. This happens in the task director process,
  * so if we have multiple pong groups each has its own sems[] array.
@@ -59,6 +80,7 @@ void
 pong_prep(unsigned groupid, unsigned count)
 {
 	unsigned i;
+	int fd;
 
 	if (count > MAXCOUNT) {
 		err(1, "pong: too many pongers -- recompile pong.c");
@@ -67,6 +89,109 @@ pong_prep(unsigned groupid, unsigned count)
 		usem_init(&sems[i], "sem:pong-%u-%u", groupid, i);
 	}
 	nsems = count;
+
+	snprintf(timesfile, sizeof(timesfile), "pongtimes-%u", groupid);
+	fd = open(timesfile, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", timesfile);
+	}
+	close(fd);
+}
+
+static
+uint64_t
+stamp(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Move one ponger's timestamps to or from the times file.
+ */
+static
+void
+pong_times(int fd, unsigned id, int save)
+{
+	off_t pos;
+	ssize_t r1, r2;
+
+	pos = (off_t)id * (sizeof(sendtimes) + sizeof(waketimes));
+	if (lseek(fd, pos, SEEK_SET) == -1) {
+		err(1, "%s: lseek", timesfile);
+	}
+	if (save) {
+		r1 = write(fd, sendtimes, sizeof(sendtimes));
+		r2 = write(fd, waketimes, sizeof(waketimes));
+	}
+	else {
+		r1 = read(fd, sendtimes, sizeof(sendtimes));
+		r2 = read(fd, waketimes, sizeof(waketimes));
+	}
+	if (r1 < 0 || r2 < 0) {
+		err(1, "%s: %s", timesfile, save ? "write" : "read");
+	}
+	if ((size_t)r1 < sizeof(sendtimes) || (size_t)r2 < sizeof(waketimes)) {
+		errx(1, "%s: short %s", timesfile, save ? "write" : "read");
+	}
+}
+
+static
+int
+latcmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Pair every wakeup with the V that caused it and print percentiles
+ * of the time between the two.
+ */
+static
+void
+pong_report(unsigned groupid, unsigned count)
+{
+	static uint64_t prevsends[NSTAMPS];
+	uint64_t *lat;
+	unsigned i, j, n;
+	int fd;
+
+	lat = malloc(count * NSTAMPS * sizeof(*lat));
+	if (lat == NULL) {
+		err(1, "pong: malloc");
+	}
+	fd = open(timesfile, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", timesfile);
+	}
+	n = 0;
+	pong_times(fd, count - 1, 0);
+	for (i=0; i<count; i++) {
+		for (j=0; j<NSTAMPS; j++) {
+			prevsends[j] = sendtimes[j];
+		}
+		pong_times(fd, i, 0);
+		for (j=0; j<NSTAMPS; j++) {
+			lat[n++] = waketimes[j] > prevsends[j] ?
+				waketimes[j] - prevsends[j] : 0;
+		}
+	}
+	close(fd);
+
+	qsort(lat, n, sizeof(*lat), latcmp);
+	tprintf("Pong group %u wakeup latency (usec, %u wakeups): "
+		"50%% %llu, 90%% %llu, 99%% %llu, max %llu\n",
+		groupid - 2, n,
+		(unsigned long long)lat[n / 2] / 1000,
+		(unsigned long long)lat[n * 9 / 10] / 1000,
+		(unsigned long long)lat[n * 99 / 100] / 1000,
+		(unsigned long long)lat[n - 1] / 1000);
+	free(lat);
 }
 
 void
@@ -75,8 +200,10 @@ pong_cleanup(unsigned groupid, unsigned count)
 	unsigned i;
 
 	assert(nsems == count);
-	(void)groupid;
-	
+
+	pong_report(groupid, count);
+	(void)remove(timesfile);
+
 	for (i=0; i<count; i++) {
 		usem_cleanup(&sems[i]);
 	}
@@ -98,6 +225,7 @@ pong_cyclic(unsigned id)
 	for (i=0; i<PONGLOOPS; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			waketimes[nwakes++] = stamp();
 		}
 #ifdef VERBOSE_PONG
 		tprintf(" %u", id);
@@ -106,10 +234,12 @@ pong_cyclic(unsigned id)
 			putchar('.');
 		}
 #endif
+		sendtimes[nsends++] = stamp();
 		V(&sems[nextid]);
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		waketimes[nwakes++] = stamp();
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -185,6 +315,7 @@ void
 pong(unsigned groupid, unsigned id)
 {
 	unsigned idfwd, idback;
+	int fd;
 
 	(void)groupid;
 
@@ -208,4 +339,12 @@ pong(unsigned groupid, unsigned id)
 	usem_close(&sems[id]);
 	usem_close(&sems[idfwd]);
 	usem_close(&sems[idback]);
+
+	assert(nsends == NSTAMPS && nwakes == NSTAMPS);
+	fd = open(timesfile, O_WRONLY);
+	if (fd < 0) {
+		err(1, "%s", timesfile);
+	}
+	pong_times(fd, id, 1);
+	close(fd);
 }
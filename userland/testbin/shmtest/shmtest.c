@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * shmtest.c
+ *
+ * Checks shared memory segments: a child's writes show up in its
+ * parent whether the child inherited the attachment or attached the
+ * segment by key itself, a removed segment stays usable until the last
+ * detach, and a segment larger than memory survives being paged out
+ * and in again. Then times handing buffers to a child through a
+ * segment against writing and reading them through a file.
+ */
+
+#include <sys/types.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define PageSize	4096
+#define Key		161
+#define SmallPages	16
+#define BigPages	1024		/* 4M, more than sys161 has by default */
+#define Rounds		64
+#define FileName	"shmtest.dat"
+
+static
+char
+pattern(int off)
+{
+	return 'a' + (off / PageSize + off) % 26;
+}
+
+static
+void
+waitchild(pid_t pid, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "%s: waitpid", what);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%s: child failed", what);
+	}
+}
+
+static
+void
+fill(char *p, int npages)
+{
+	int i;
+
+	for (i = 0; i < npages * PageSize; i += 64) {
+		p[i] = pattern(i);
+	}
+}
+
+static
+void
+check(const char *p, int npages, const char *what)
+{
+	int i;
+
+	for (i = 0; i < npages * PageSize; i += 64) {
+		if (p[i] != pattern(i)) {
+			errx(1, "%s: byte %d is %d, not %c",
+			     what, i, p[i], pattern(i));
+		}
+	}
+}
+
+static
+void
+inherited(void)
+{
+	char *p;
+	int id;
+	pid_t pid;
+
+	id = shmget(IPC_PRIVATE, SmallPages * PageSize, 0600);
+	if (id < 0) {
+		err(1, "shmget");
+	}
+	p = shmat(id, NULL, 0);
+	if (p == (void *)-1) {
+		err(1, "shmat");
+	}
+	if (p[0] != 0 || p[SmallPages * PageSize - 1] != 0) {
+		errx(1, "inherited: segment not zero-filled");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		fill(p, SmallPages);
+		_exit(0);
+	}
+	waitchild(pid, "inherited");
+	check(p, SmallPages, "inherited");
+	if (shmdt(p) || shmctl(id, IPC_RMID, NULL)) {
+		err(1, "inherited: cleanup");
+	}
+	printf("inherited attachment: ok\n");
+}
+
+static
+void
+bykey(void)
+{
+	char *p, *q;
+	int id;
+	pid_t pid;
+
+	id = shmget(Key, SmallPages * PageSize, IPC_CREAT | IPC_EXCL | 0600);
+	if (id < 0) {
+		err(1, "shmget");
+	}
+	if (shmget(Key, PageSize, IPC_CREAT | IPC_EXCL | 0600) >= 0 ||
+	    errno != EEXIST) {
+		errx(1, "bykey: IPC_EXCL did not fail");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		q = shmat(shmget(Key, PageSize, 0), NULL, 0);
+		if (q == (void *)-1) {
+			err(1, "child shmat");
+		}
+		fill(q, SmallPages);
+		_exit(0);
+	}
+	waitchild(pid, "bykey");
+
+	p = shmat(id, NULL, SHM_RDONLY);
+	if (p == (void *)-1) {
+		err(1, "shmat");
+	}
+	check(p, SmallPages, "bykey");
+
+	/* gone for lookups, but still there for us */
+	if (shmctl(id, IPC_RMID, NULL)) {
+		err(1, "shmctl");
+	}
+	if (shmget(Key, PageSize, 0) >= 0 || errno != ENOENT) {
+		errx(1, "bykey: removed segment still found");
+	}
+	check(p, SmallPages, "bykey after IPC_RMID");
+	if (shmdt(p)) {
+		err(1, "shmdt");
+	}
+	printf("attach by key: ok\n");
+}
+
+static
+void
+big(void)
+{
+	char *p;
+	int id;
+	pid_t pid;
+
+	id = shmget(IPC_PRIVATE, BigPages * PageSize, 0600);
+	if (id < 0) {
+		err(1, "shmget big");
+	}
+	p = shmat(id, NULL, 0);
+	if (p == (void *)-1) {
+		err(1, "shmat big");
+	}
+	shmctl(id, IPC_RMID, NULL);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		fill(p, BigPages);
+		check(p, BigPages, "big (child)");
+		_exit(0);
+	}
+	waitchild(pid, "big");
+	check(p, BigPages, "big");
+	shmdt(p);
+	printf("%dK segment through swap: ok\n", BigPages * PageSize / 1024);
+}
+
+static
+unsigned long
+msecs_since(time_t secs, unsigned long nsecs)
+{
+	time_t nowsecs;
+	unsigned long nownsecs, ms;
+
+	__time(&nowsecs, &nownsecs);
+	ms = (nowsecs - secs) * 1000;
+	ms = ms + nownsecs / 1000000 - nsecs / 1000000;
+	return ms == 0 ? 1 : ms;
+}
+
+/*
+ * The parent fills Rounds buffers of SmallPages pages for one child to
+ * check, taking turns on a flag word in a segment: first with the
+ * buffer in the segment too, then written to and read from a file.
+ */
+static
+void
+timing(bool usefile)
+{
+	static char buf[SmallPages * PageSize];
+	volatile int *turn;
+	char *p, *data;
+	time_t secs;
+	unsigned long nsecs, ms;
+	int id, fd, r, i, n;
+	pid_t pid;
+
+	id = shmget(IPC_PRIVATE, (SmallPages + 1) * PageSize, 0600);
+	p = id < 0 ? (void *)-1 : shmat(id, NULL, 0);
+	if (p == (void *)-1) {
+		err(1, "timing: shm");
+	}
+	shmctl(id, IPC_RMID, NULL);
+	turn = (volatile int *)(p + SmallPages * PageSize);
+	data = usefile ? buf : p;
+	fd = -1;
+	if (usefile) {
+		fd = open(FileName, O_RDWR | O_CREAT | O_TRUNC, 0664);
+		if (fd < 0) {
+			err(1, "%s: open", FileName);
+		}
+	}
+
+	__time(&secs, &nsecs);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (r = 0; r < Rounds; r++) {
+			while (*turn != 1) {
+				;
+			}
+			if (usefile) {
+				lseek(fd, 0, SEEK_SET);
+				for (i = 0; i < (int)sizeof(buf); i += n) {
+					n = read(fd, buf + i, sizeof(buf) - i);
+					if (n <= 0) {
+						err(1, "%s: read", FileName);
+					}
+				}
+			}
+			check(data, SmallPages, "timing");
+			*turn = 0;
+		}
+		_exit(0);
+	}
+	for (r = 0; r < Rounds; r++) {
+		while (*turn != 0) {
+			;
+		}
+		fill(data, SmallPages);
+		if (usefile) {
+			lseek(fd, 0, SEEK_SET);
+			if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+				err(1, "%s: write", FileName);
+			}
+		}
+		*turn = 1;
+	}
+	waitchild(pid, "timing");
+	ms = msecs_since(secs, nsecs);
+	printf("%s %d rounds of %dK in %lu ms\n",
+	       usefile ? "through a file:   " : "in shared memory: ",
+	       Rounds, SmallPages * PageSize / 1024, ms);
+	if (usefile) {
+		close(fd);
+	}
+	shmdt(p);
+}
+
+int
+main(void)
+{
+	inherited();
+	bykey();
+	big();
+	timing(false);
+	timing(true);
+	printf("shmtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vmscale.c
+ *
+ * Measures how fresh-page throughput scales with the number of
+ * processes faulting at once. For 1, 2, 4 and 8 workers, each worker
+ * grows its heap with sbrk, reads every new page and then writes it.
+ * Prints pages touched per second for each worker count, and next to
+ * it the faults the kernel took for them per second, from getrusage.
+ *
+ * The two differ: how many faults a page costs depends on the VM (a
+ * read fault onto the shared zero frame and then a write fault, or
+ * none at all if the page was zero-filled ahead), so compare kernels
+ * by pages/sec and the fault path itself by faults/sec.
+ *
+ * Only the number of workers varies, not the number of CPUs: set that
+ * with cpus= on the mainboard line of sys161.conf (8 to let every
+ * worker have one). With fewer CPUs the larger counts just time-share.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <err.h>
+
+#define PageSize	4096
+#define NumPages	256		/* per worker; 1M */
+#define MaxWorkers	8
+
+static
+void
+worker(void)
+{
+	char *p;
+	int i, j;
+
+	p = sbrk(NumPages * PageSize);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i = 0; i < NumPages; i++) {
+		for (j = 0; j < PageSize; j += 512) {
+			if (p[i * PageSize + j] != 0) {
+				errx(1, "page %d not zero-filled", i);
+			}
+		}
+		p[i * PageSize] = 1;
+	}
+	exit(0);
+}
+
+static
+void
+run(int nworkers)
+{
+	pid_t pids[MaxWorkers];
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long msecs, pages, faults;
+	struct rusage before, after;
+	int i, status, failed = 0;
+
+	if (getrusage(RUSAGE_CHILDREN, &before) < 0) {
+		err(1, "getrusage");
+	}
+	__time(&startsecs, &startnsecs);
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			worker();
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+	__time(&endsecs, &endnsecs);
+	if (getrusage(RUSAGE_CHILDREN, &after) < 0) {
+		err(1, "getrusage");
+	}
+
+	if (failed) {
+		errx(1, "%d of %d workers failed", failed, nworkers);
+	}
+
+	msecs = (endsecs - startsecs) * 1000;
+	msecs = msecs + endnsecs / 1000000 - startnsecs / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	pages = (unsigned long)nworkers * NumPages;
+	faults = (unsigned long)(after.ru_minflt + after.ru_majflt -
+				 before.ru_minflt - before.ru_majflt);
+	printf("%d worker(s): %lu pages touched in %lu ms, %lu pages/sec; "
+	       "%lu faults, %lu faults/sec\n",
+	       nworkers, pages, msecs, pages * 1000 / msecs,
+	       faults, (unsigned long)((unsigned long long)faults * 1000 / msecs));
+}
+
+int
+main(void)
+{
+	int n;
+
+	printf("vmscale: %d pages per worker\n", NumPages);
+	for (n = 1; n <= MaxWorkers; n *= 2) {
+		run(n);
+	}
+	return 0;
+}